@@ -0,0 +1,462 @@
+#include "OGRE/Ogre.h"
+#include "OIS/OIS.h"
+#include "Gorilla.h"
+#include "Monkey.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <thread>
+
+#pragma warning ( disable : 4244 )
+
+// Headless benchmark of Monkey's stylesheet loading, MAML parsing, element construction, layout and
+// hit testing. Synthetic stylesheets and MAML trees are written to a scratch resource location, the
+// PuzzleTrees draw through a RecordingBackend and the results are printed as JSON.
+//
+//   benchmark [--rules N] [--depth D] [--fanout F] [--classes K] [--iterations I] [--moves M] [--out file.json]
+//             [--trace trace.json] [--threads T]
+//
+// --trace needs Monkey built with MONKEY_TRACING.
+
+class Benchmark
+{
+
+ public:
+
+  struct Result
+  {
+   std::string name;
+   size_t operations;
+   double total_ms;
+  };
+
+  Benchmark()
+  : mRules(200), mDepth(4), mFanOut(4), mClasses(16), mIterations(20), mMoves(10000), mThreads(1), mSeed(1), mCommandErrors(0)
+  {
+  }
+
+  void parse(int argc, char** argv)
+  {
+   for (int i=1;i + 1 < argc;i += 2)
+   {
+    std::string key(argv[i]);
+    size_t value = Ogre::StringConverter::parseUnsignedInt(argv[i+1]);
+    if (key == "--rules")
+     mRules = value;
+    else if (key == "--depth")
+     mDepth = value;
+    else if (key == "--fanout")
+     mFanOut = value;
+    else if (key == "--classes")
+     mClasses = std::max<size_t>(value, 1);
+    else if (key == "--iterations")
+     mIterations = std::max<size_t>(value, 1);
+    else if (key == "--moves")
+     mMoves = value;
+    else if (key == "--out")
+     mOut = argv[i+1];
+    else if (key == "--threads")
+     mThreads = std::max<size_t>(value, 1);
+    else if (key == "--trace")
+     mTrace = argv[i+1];
+   }
+  }
+
+  // False if a check failed; see the report's "checks".
+  bool run()
+  {
+
+   mRoot = new Ogre::Root("", "", "benchmark.log");
+
+   _writeFiles();
+
+   Ogre::ResourceGroupManager* rgm = Ogre::ResourceGroupManager::getSingletonPtr();
+   rgm->addResourceLocation("monkey-benchmark", "FileSystem");
+   rgm->initialiseAllResourceGroups();
+
+   Monkey::Trace::setEnabled(mTrace.length() != 0);
+
+   _benchLoadCSS();
+   _benchMaml();
+   _benchConstruction();
+   _benchCommands();
+
+   _report();
+
+   if (mTrace.length())
+    Monkey::Trace::write(mTrace);
+
+   delete mRoot;
+   return mCommandErrors == 0;
+  }
+
+ protected:
+
+  typedef std::chrono::high_resolution_clock Clock;
+
+  double _ms(Clock::time_point start)
+  {
+   return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  }
+
+  // Deterministic so runs across releases see the same trees and pointer paths.
+  size_t _random(size_t range)
+  {
+   mSeed = mSeed * 1103515245 + 12345;
+   return ((mSeed >> 16) & 0x7FFF) % range;
+  }
+
+  std::string _classes()
+  {
+   std::stringstream s;
+   s << ".c" << _random(mClasses);
+   if (_random(2))
+    s << ".c" << _random(mClasses);
+   return s.str();
+  }
+
+  void _writeFiles()
+  {
+
+#ifdef _WIN32
+   system("mkdir monkey-benchmark");
+#else
+   system("mkdir -p monkey-benchmark");
+#endif
+
+   // Stylesheet; the generated class rules cycle through the class mix.
+   {
+    std::ofstream css("monkey-benchmark/benchmark.monkey-css");
+    css << "@import (\"rendezvous\");\n\n";
+    css << "button\n{\n\tbackground-color: rgb(48,48,48);\n\tborder: 2 rgb(32,32,32);\n\ttext-align: center;\n\tvertical-align: middle;\n}\n\n";
+    css << "button:hover\n{\n\tbackground-color: rgb(48,64,48);\n}\n\n";
+    css << "button:active\n{\n\tborder-left: rgb(64,64,64);\n}\n\n";
+    css << "textbox\n{\n\tbackground-color: rgb(48,48,48);\n\tborder: 2 rgb(32,32,32);\n}\n\n";
+    css << "osk\n{\n\twidth: 100%;\n\theight: 100%;\n\tbackground-color: rgb(32,32,32,220);\n}\n\n";
+    for (size_t i=0;i < mRules;i++)
+    {
+     css << (i < mClasses ? ".c" : ".r") << i << "\n{\n";
+     css << "\tleft: " << _random(40) << "%;\n";
+     css << "\ttop: " << _random(40) << "%;\n";
+     css << "\twidth: " << 20 + _random(60) << "%;\n";
+     css << "\theight: " << 20 + _random(60) << "%;\n";
+     if (_random(2))
+      css << "\tbackground-color: rgb(" << _random(256) << "," << _random(256) << "," << _random(256) << ");\n";
+     if (_random(3) == 0)
+      css << "\tborder: 1 rgb(255,255,255);\n";
+     css << "\tfont: 14;\n";
+     css << "}\n\n";
+    }
+   }
+
+   {
+    std::ofstream maml("monkey-benchmark/required.maml");
+    maml << "%osk\n\t%osk-title=Title\n\t%osk-input=Text\n\t%osk-submit=Submit\n\t%osk-cancel=Cancel\n";
+   }
+
+   {
+    std::ofstream maml("monkey-benchmark/benchmark.maml");
+    _writeMaml(maml, 0);
+   }
+
+  }
+
+  void _writeMaml(std::ofstream& maml, size_t depth)
+  {
+   size_t count = depth == 0 ? 1 : mFanOut;
+   for (size_t i=0;i < count;i++)
+   {
+    for (size_t j=0;j < depth;j++)
+     maml << "\t";
+    size_t type = _random(4);
+    if (depth + 1 == mDepth && type == 0)
+     maml << "%button" << _classes() << "=Button";
+    else if (depth + 1 == mDepth && type == 1)
+     maml << "%textbox" << _classes() << "(title=\"Title\")=Text";
+    else
+     maml << "%block" << _classes();
+    maml << "\n";
+    if (depth + 1 < mDepth)
+     _writeMaml(maml, depth + 1);
+   }
+  }
+
+  Monkey::PuzzleTree* _createTree(Monkey::RecordingBackend* backend)
+  {
+   return new Monkey::PuzzleTree("benchmark.monkey-css", backend, &mCallback);
+  }
+
+  void _benchLoadCSS()
+  {
+   Monkey::RecordingBackend backend(1024, 768);
+   Monkey::PuzzleTree* tree = _createTree(&backend);
+   Clock::time_point start = Clock::now();
+   for (size_t i=0;i < mIterations;i++)
+    tree->loadCSS("benchmark.monkey-css");
+   _result("loadCSS", mIterations, _ms(start));
+   delete tree;
+  }
+
+  void _benchMaml()
+  {
+   double total = 0;
+   for (size_t i=0;i < mIterations;i++)
+   {
+    Monkey::RecordingBackend backend(1024, 768);
+    Monkey::PuzzleTree* tree = _createTree(&backend);
+    tree->setCascadeThreads(mThreads);
+    Clock::time_point start = Clock::now();
+    tree->maml("benchmark.maml");
+    total += _ms(start);
+    delete tree;
+   }
+   _result("maml", mIterations, total);
+  }
+
+  void _build(Monkey::PuzzleTree* tree, Monkey::Element* parent, size_t depth, std::vector<Monkey::Element*>& roots)
+  {
+   size_t count = depth == 0 ? 1 : mFanOut;
+   for (size_t i=0;i < count;i++)
+   {
+    int type = Monkey::ElementType_Block;
+    if (depth + 1 == mDepth && _random(2) == 0)
+     type = Monkey::ElementType_Button;
+    Monkey::Element* elem = 0;
+    if (parent)
+     elem = parent->createChild(_classes(), type);
+    else
+    {
+     elem = tree->createElement(_classes(), type);
+     roots.push_back(elem);
+    }
+    if (type == Monkey::ElementType_Button)
+     elem->setText("Button");
+    if (depth + 1 < mDepth)
+     _build(tree, elem, depth + 1, roots);
+   }
+  }
+
+  void _benchConstruction()
+  {
+
+   Monkey::RecordingBackend backend(1024, 768);
+   Monkey::PuzzleTree* tree = _createTree(&backend);
+   std::vector<Monkey::Element*> roots;
+
+   size_t elements = 0;
+   for (size_t i=0, n=1;i < mDepth;i++, n *= mFanOut)
+    elements += n;
+
+   Clock::time_point start = Clock::now();
+   for (size_t i=0;i < mIterations;i++)
+    _build(tree, 0, 0, roots);
+   _result("construction", elements * mIterations, _ms(start));
+
+   backend.resetCounters();
+   start = Clock::now();
+   for (size_t i=0;i < mIterations;i++)
+    for (size_t j=0;j < roots.size();j++)
+     roots[j]->reapplyLook();
+   _result("reapplyLook", elements * roots.size() * mIterations, _ms(start));
+
+   start = Clock::now();
+   for (size_t i=0;i < mIterations;i++)
+   {
+    for (size_t j=0;j < roots.size();j++)
+     roots[j]->hide();
+    for (size_t j=0;j < roots.size();j++)
+     roots[j]->show();
+   }
+   _result("hideShow", roots.size() * mIterations, _ms(start));
+
+   _benchPointer(tree, "pointerSweep", false);
+   _benchPointer(tree, "pointerRandomWalk", true);
+
+   mCounters = backend.getCounters();
+   tree->getMemoryReport(mMemory);
+   delete tree;
+  }
+
+  // The text a producer sets on its element for its k'th push; its length varies so texts straddle
+  // arena offsets. Text read from an arena that was reused before the command ran will not match.
+  static std::string _commandText(size_t producer, size_t k)
+  {
+   std::stringstream s;
+   s << producer << "." << k << "." << std::string(k % 37, char('a' + k % 26));
+   return s.str();
+  }
+
+  static bool _isCommandText(const std::string& text, size_t producer)
+  {
+   size_t dot = text.find('.'), second = text.find('.', dot + 1);
+   if (dot == std::string::npos || second == std::string::npos || text.substr(0, dot) != Ogre::StringConverter::toString(producer))
+    return false;
+   return text == _commandText(producer, Ogre::StringConverter::parseUnsignedInt(text.substr(dot + 1, second - dot - 1)));
+  }
+
+  // Producers push text while the main thread updates; with more producers than cores some are
+  // descheduled between taking a ring ticket and publishing it, across an arena swap. Every text the
+  // elements are given must be whole.
+  void _benchCommands()
+  {
+
+   Monkey::RecordingBackend backend(1024, 768);
+   Monkey::PuzzleTree* tree = _createTree(&backend);
+   Monkey::CommandQueue* queue = tree->getCommandQueue();
+
+   size_t producers = std::max<size_t>(mThreads, 2), pushes = mMoves;
+   std::vector<Monkey::Element*> elements;
+   for (size_t i=0;i < producers;i++)
+    elements.push_back(tree->createElement(".c0", Monkey::ElementType_Block));
+
+   std::atomic<size_t> running(producers);
+   std::vector<std::thread> threads;
+   Clock::time_point start = Clock::now();
+   for (size_t i=0;i < producers;i++)
+   {
+    threads.push_back(std::thread([&, i]()
+    {
+     for (size_t k=0;k < pushes;k++)
+     {
+      while (queue->setText(elements[i], _commandText(i, k)) == false)
+       std::this_thread::yield();
+      if (k % 64 == i)
+       std::this_thread::yield();
+     }
+     running--;
+    }));
+   }
+
+   size_t updates = 0;
+   while (running.load() != 0 || updates < 2)
+   {
+    tree->update();
+    updates++;
+    for (size_t i=0;i < producers;i++)
+     if (elements[i]->getText().length() && _isCommandText(elements[i]->getText(), i) == false)
+      mCommandErrors++;
+   }
+   for (size_t i=0;i < threads.size();i++)
+    threads[i].join();
+   tree->update();
+   tree->update();
+
+   for (size_t i=0;i < producers;i++)
+    if (elements[i]->getText() != _commandText(i, pushes - 1))
+     mCommandErrors++;
+
+   _result("commands", producers * pushes, _ms(start));
+   delete tree;
+  }
+
+  void _benchPointer(Monkey::PuzzleTree* tree, const std::string& name, bool randomWalk)
+  {
+
+   OIS::MouseState state;
+   state.width = 1024;
+   state.height = 768;
+   OIS::MouseEvent evt(0, state);
+
+   Clock::time_point start = Clock::now();
+   for (size_t i=0;i < mMoves;i++)
+   {
+    if (randomWalk)
+    {
+     state.X.abs = std::min(std::max(int(state.X.abs) + int(_random(41)) - 20, 0), 1023);
+     state.Y.abs = std::min(std::max(int(state.Y.abs) + int(_random(41)) - 20, 0), 767);
+    }
+    else
+    {
+     // Rows of horizontal sweeps down the screen.
+     state.X.abs = int((i * 7) % 1024);
+     state.Y.abs = int(((i * 7) / 1024) * 16 % 768);
+    }
+
+    tree->mouseMoved(evt);
+
+    // Click every hundredth move; leave any text mode it starts.
+    if (i % 100 == 99)
+    {
+     state.buttons = 1;
+     tree->mousePressed(evt, OIS::MB_Left);
+     state.buttons = 0;
+     tree->mouseReleased(evt, OIS::MB_Left);
+     tree->onKeyCancel();
+    }
+   }
+   _result(name, mMoves, _ms(start));
+  }
+
+  void _result(const std::string& name, size_t operations, double total_ms)
+  {
+   Result result = { name, operations, total_ms };
+   mResults.push_back(result);
+  }
+
+  void _report()
+  {
+   std::stringstream s;
+   s << "{\n";
+   s << " \"config\": { \"rules\": " << mRules << ", \"depth\": " << mDepth << ", \"fanout\": " << mFanOut
+     << ", \"classes\": " << mClasses << ", \"iterations\": " << mIterations << ", \"moves\": " << mMoves << ", \"threads\": " << mThreads << " },\n";
+   s << " \"results\": {\n";
+   for (size_t i=0;i < mResults.size();i++)
+   {
+    const Result& r = mResults[i];
+    s << "  \"" << r.name << "\": { \"operations\": " << r.operations << ", \"total_ms\": " << r.total_ms
+      << ", \"per_operation_us\": " << (r.operations ? r.total_ms * 1000.0 / r.operations : 0) << " }";
+    s << (i + 1 < mResults.size() ? ",\n" : "\n");
+   }
+   s << " },\n";
+   s << " \"primitives\": { \"rectangles_created\": " << mCounters.rectangles_created
+     << ", \"rectangles_destroyed\": " << mCounters.rectangles_destroyed
+     << ", \"captions_created\": " << mCounters.captions_created
+     << ", \"captions_destroyed\": " << mCounters.captions_destroyed
+     << ", \"setter_calls\": " << mCounters.setter_calls << " },\n";
+   const Monkey::MemoryUsage& m = mMemory.total;
+   s << " \"memory\": { \"elements\": " << m.elements << ", \"looks\": " << m.looks << ", \"styles\": " << m.styles
+     << ", \"strings\": " << m.strings << ", \"containers\": " << m.containers << ", \"listeners\": " << m.listeners
+     << ", \"primitives\": " << m.primitives << ", \"total\": " << m.total() << " },\n";
+   s << " \"checks\": { \"commands_corrupted\": " << mCommandErrors << " }\n";
+   s << "}\n";
+
+   if (mOut.length())
+   {
+    std::ofstream out(mOut.c_str());
+    out << s.str();
+   }
+   else
+    std::cout << s.str();
+  }
+
+  size_t mRules, mDepth, mFanOut, mClasses, mIterations, mMoves, mThreads;
+  unsigned int mSeed;
+  std::string mOut, mTrace;
+  Ogre::Root* mRoot;
+  Monkey::Callback mCallback;
+  std::vector<Result> mResults;
+  Monkey::RecordingBackend::Counters mCounters;
+  Monkey::MemoryReport mMemory;
+  size_t mCommandErrors;
+
+};
+
+int main(int argc, char** argv)
+{
+
+ try
+ {
+  Benchmark benchmark;
+  benchmark.parse(argc, argv);
+  if (benchmark.run() == false)
+   return 1;
+ }
+ catch(Ogre::Exception& e)
+ {
+  std::cout << "--------\n" << e.getFullDescription() << "\n\n";
+  return 1;
+ }
+
+ return 0;
+}
@@ -26,6 +26,19 @@
 
 #include "Monkey.h"
 
+#include <chrono>
+#include <fstream>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <sys/stat.h>
+#ifdef __linux__
+# include <sys/inotify.h>
+# include <unistd.h>
+#endif
+
 #pragma warning ( disable : 4244 )
 
 namespace Monkey
@@ -549,210 +562,77 @@ std::string maml_id_css_expand(const std::string& string)
  return ret;
 }
 
-Gorilla::Rectangle* CSS_GorillaRectangle(ElementStyle* style, Gorilla::Layer* layer, Gorilla::Screen* screen)
+// The id given by MAML selectors, if any.
+std::string maml_id(const std::string& selectors)
 {
-  if (style == 0)
-   return layer->createRectangle(0,0,16,16);
-  
-  float x = style->left,
-       y = style->top,
-       w = style->width,
-       h = style->height,
-       screenW = screen->getWidth(),
-       screenH = screen->getHeight();
-  
-  if (style->left_unit == Unit_Percent)
-     x *= screenW;
-  if (style->top_unit == Unit_Percent)
-     y *= screenH;
-  if (style->width_unit == Unit_Percent)
-     w *= screenW;
-  if (style->height_unit == Unit_Percent)
-     h *= screenH;
-  
- Gorilla::Rectangle* rect = layer->createRectangle(x,y,w,h);
-
- if (style->background.type == ElementStyle::Background::BT_Colour)
-  rect->background_colour(style->background.colour);
- else if (style->background.type == ElementStyle::Background::BT_Sprite)
- {
-  rect->background_image(style->background.sprite);
- }
- else
-  rect->no_background();
-  
- if (style->border.width == 0)
-  rect->no_border();
- else
-  rect->border(style->border.width, style->border.top, style->border.right, style->border.bottom, style->border.left);
-
- return rect;
+ Ogre::vector<Ogre::String>::type tokens = Ogre::StringUtil::split(maml_id_css_expand(selectors), " ");
+ std::string id;
+ for (size_t i=0;i < tokens.size();i++)
+  if (tokens[i].length() && tokens[i][0] == '#' && has(tokens[i], ':') == false)
+   id = slice_copy(tokens[i], 1);
+ return id;
 }
 
-Gorilla::Caption* CSS_GorillaCaption(ElementStyle* style, Gorilla::Layer* layer, Gorilla::Screen* screen)
+// Children of each node in order, the last list holding the top-level nodes.
+void maml_children(const std::vector<MamlNode>& nodes, std::vector<std::vector<size_t> >& children)
 {
-  if (style == 0)
-   return layer->createCaption(9,0,0, "");
-  
-  float x = style->left,
-       y = style->top,
-       w = style->width,
-       h = style->height,
-       screenW = screen->getWidth(),
-       screenH = screen->getHeight();
-  
-  if (style->left_unit == Unit_Percent)
-     x *= screenW;
-  if (style->top_unit == Unit_Percent)
-     y *= screenH;
-  if (style->width_unit == Unit_Percent)
-     w *= screenW;
-  if (style->height_unit == Unit_Percent)
-     h *= screenH;
-  
-  Gorilla::Caption* cap = layer->createCaption(style->font, x,y,"");
-  cap->width(w);
-  cap->height(h);
-  cap->colour(style->colour);
-  cap->align(style->alignment.horz);
-  cap->vertical_align(style->alignment.vert);
-  
-  if (style->background.type == ElementStyle::Background::BT_Colour)
-  {
-   cap->background(style->background.colour);
-  }
-  else
-  {
-   cap->no_background();
-  }
-  
-  return cap;
+ children.assign(nodes.size() + 1, std::vector<size_t>());
+ for (size_t i=0;i < nodes.size();i++)
+  children[nodes[i].parent == std::string::npos ? nodes.size() : nodes[i].parent].push_back(i);
 }
 
-} // namespace SecretMonkey
-
-
-// -----------------------------------------------------------------------------------------
-
+// Heap held by a string beyond its small string buffer.
+size_t stringBytes(const std::string& str)
+{
+ static const size_t small = std::string().capacity();
+ return str.capacity() > small ? str.capacity() + 1 : 0;
+}
 
-PuzzleTree::PuzzleTree(const Ogre::String& css, Ogre::Viewport* viewport, Callback* callback)
-: mViewport(viewport),
-  mCallback(callback),
-  mLastEventElement(0),
-  mCurrentTextElement(0)
+// A node of a std::map or std::multimap; the value plus the tree links and colour.
+template<typename T> size_t mapNodeBytes()
 {
- 
- loadCSS(css);
- 
- mElementTypes[ElementType_Block] = "block";
- mElementTypes[ElementType_Button] = "button";
- mElementTypes[ElementType_TextBox] = "textbox";
- mElementTypes[ElementType_OSKContainer] = "osk";
- mElementTypes[ElementType_OSKTitle] = "osk-title";
- mElementTypes[ElementType_OSKInput] = "osk-input";
- mElementTypes[ElementType_OSKSubmit] = "osk-submit";
- mElementTypes[ElementType_OSKCancel] = "osk-cancel";
- 
- mSilverback = Gorilla::Silverback::getSingletonPtr();
- 
- if (mSilverback == 0)
-  mSilverback = new Gorilla::Silverback();
- 
- mSilverback->loadAtlas(mAtlas);
- mScreen = mSilverback->createScreen(mViewport, mAtlas);
- 
- for (size_t i=0;i < 16;i++)
-  mLayers[i] = mScreen->createLayer(i);
- 
- ElementStyle* style = getStyle("mousepointer");
- if (style == 0)
-  mMousePointer = mLayers[15]->createRectangle(0,0,32,32);
- else
- {
-  float x = style->left,
-       y = style->top,
-       w = style->width,
-       h = style->height,
-       screenW = mScreen->getWidth(),
-       screenH = mScreen->getHeight();
-  
-  if (style->left_unit == Unit_Percent)
-   x *= screenW;
-  if (style->top_unit == Unit_Percent)
-     y *= screenH;
-  if (style->width_unit == Unit_Percent)
-     w *= screenW;
-  if (style->height_unit == Unit_Percent)
-     h *= screenH;
-  
-  mMousePointer = mLayers[15]->createRectangle(x,y,w,h);
-  
-  if (style->background.type == ElementStyle::Background::BT_Colour)
-   mMousePointer->background_colour(style->background.colour);
-  else if (style->background.type == ElementStyle::Background::BT_Sprite)
-  {
-   mMousePointer->background_image(style->background.sprite);
-  }
-  else
-   mMousePointer->no_background();
-  
-  if (style->border.width == 0)
-   mMousePointer->no_border();
-  else
-   mMousePointer->border(style->border.width, style->border.top, style->border.right, style->border.bottom, style->border.left);
-  
- }
- 
- maml("required.maml");
- mSingletonElements[ElementType_OSKContainer]->hide();
+ return sizeof(T) + 4 * sizeof(void*);
 }
 
-PuzzleTree::~PuzzleTree()
+size_t styleStringBytes(const ElementStyle& style)
 {
- // TODO: Cleanup
+ return stringBytes(style.background.sprite);
 }
 
-void PuzzleTree::maml(const Ogre::String& maml_path)
+Ogre::DataStreamPtr openResource(const Ogre::String& path)
 {
- 
- namespace S = ::Monkey::SecretMonkey;
- 
- S::StringPair sp;
  bool didCut = false;
- sp = S::cut(maml_path, didCut, ':', 0);
-
- Ogre::DataStreamPtr stream;
+ StringPair sp = cut(path, didCut, ':', 0);
  if (didCut)
-  stream = Ogre::ResourceGroupManager::getSingleton().openResource(sp.second, sp.first);
- else
-  stream = Ogre::ResourceGroupManager::getSingleton().openResource(maml_path, Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME);
+  return Ogre::ResourceGroupManager::getSingleton().openResource(sp.second, sp.first);
+ return Ogre::ResourceGroupManager::getSingleton().openResource(path, Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME);
+}
+
+// Reads MAML into nodes, parents before their children. Touches no PuzzleTree, so it may run on any thread.
+void parseMaml(Ogre::DataStreamPtr stream, const std::map<int, std::string>& types, std::vector<MamlNode>& nodes)
+{
  
- Element* parent = 0;
- Element* previous = 0;
- Element* elem = 0;
- size_t currentIndent = 0, previousIndent = 0, parentIndent = 0;
+ size_t parent = std::string::npos;
+ size_t previous = std::string::npos;
+ size_t currentIndent = 0, previousIndent = 0;
  Ogre::String line, trimmedLine, elemID, elemData, elemAttributes;
- int elemType = ElementType_Block;
  
- ElementArgs args;
  while (!stream->eof())
  {
-  elemType = ElementType_Block;
   elemID.clear();
   elemData.clear();
   elemAttributes.clear();
   
   line = stream->getLine(false);
-  args.clear();
-  trimmedLine = S::trim_copy(line);
+  trimmedLine = trim_copy(line);
   if (trimmedLine.length() == 0)
    continue;
-  currentIndent = S::count_indent(line);
+  currentIndent = count_indent(line);
   
   if (currentIndent == 0)
   {
-   parent = 0;
-   previous = 0;
+   parent = std::string::npos;
+   previous = std::string::npos;
   }
   else if (currentIndent > previousIndent)
   {
@@ -763,15 +643,15 @@ void PuzzleTree::maml(const Ogre::String& maml_path)
    parent = previous;
    for (size_t i=0;i < (previousIndent - currentIndent) + 1;i++)
    {
-    if (parent != 0)
-     parent = parent->getParent();
+    if (parent != std::string::npos)
+     parent = nodes[parent].parent;
    }
   }
   
   
   // Check to see if there is an attribute data, block of characters between (..), but not before any =
-  size_t attr_start = S::index(trimmedLine, '(');
-  size_t attr_end = S::quoted_index(trimmedLine, ')', attr_start);
+  size_t attr_start = index(trimmedLine, '(');
+  size_t attr_end = quoted_index(trimmedLine, ')', attr_start);
   size_t data_start = 0;
   bool hasAttributes = false, hasData = false;
   
@@ -784,39 +664,47 @@ void PuzzleTree::maml(const Ogre::String& maml_path)
   // Check to see if there is any element data AFTER the attribute data.
   if (hasAttributes == true && attr_end != std::string::npos)
   {
-   data_start = S::index(trimmedLine, '=', attr_end);
+   data_start = index(trimmedLine, '=', attr_end);
    if (data_start != std::string::npos)
     hasData = true;
   }
   // No attributes, then check for some element data.
   else if (hasAttributes == false)
   {
-   data_start = S::index(trimmedLine, '=');
+   data_start = index(trimmedLine, '=');
    if (data_start != std::string::npos)
     hasData = true;
   }
   
   if (hasAttributes)
-   elemID = S::slice_copy(trimmedLine, 0, attr_start);
+   elemID = slice_copy(trimmedLine, 0, attr_start);
   else if (hasData)
-   elemID = S::slice_copy(trimmedLine, 0, data_start);
+   elemID = slice_copy(trimmedLine, 0, data_start);
   else
    elemID = trimmedLine;
   
   if (hasAttributes)
   {
-   elemAttributes = S::slice_copy(trimmedLine, attr_start+1, attr_end-1);
+   elemAttributes = slice_copy(trimmedLine, attr_start+1, attr_end-1);
   }
 
   if (hasData)
   {
-   elemData = S::slice_copy(trimmedLine, data_start+1);
+   elemData = slice_copy(trimmedLine, data_start+1);
   }
   
+  nodes.push_back(MamlNode());
+  MamlNode& node = nodes.back();
+  node.parent = parent;
+  node.type = ElementType_Block;
+  node.has_text = hasData;
+  node.text = elemData;
+  
   if (elemID[0] == '%')
   {
-   elemType = S::extract_enum(elemID, mElementTypes, "%");
+   node.type = extract_enum(elemID, types, "%");
   }
+  node.selectors = elemID;
 
   if (hasAttributes)
   {
@@ -826,15 +714,15 @@ void PuzzleTree::maml(const Ogre::String& maml_path)
    
    for (Ogre::vector<Ogre::String>::type::iterator it = attrs.begin(); it != attrs.end(); it++)
    {
-    S::trim((*it));
-    if (S::has((*it), '='))
+    trim((*it));
+    if (has((*it), '='))
     {
      key = (*it);
      value = (*it);
-     S::slice_to_first_of(key, '=');
-     S::slice_after_first_of(value, '=');
-     S::trim(key);
-     S::trim(value);
+     slice_to_first_of(key, '=');
+     slice_after_first_of(value, '=');
+     trim(key);
+     trim(value);
     }
     else
     {
@@ -842,85 +730,146 @@ void PuzzleTree::maml(const Ogre::String& maml_path)
      value = "true";
     }
     
-    S::slice_after_first_of(value, '"');
-    S::slice_after_first_of(value, '\'');
-    S::slice_to_last_of(value, '"');
-    S::slice_to_last_of(value, '\'');
+    slice_after_first_of(value, '"');
+    slice_after_first_of(value, '\'');
+    slice_to_last_of(value, '"');
+    slice_to_last_of(value, '\'');
     
-    args.insert(std::pair<std::string, std::string>(key, value));
+    node.args.insert(std::pair<std::string, std::string>(key, value));
    }
    
   }
   
-  if (parent)
-   elem = parent->createChild(elemID, elemType, args);
-  else
-   elem = createElement(elemID, elemType, args);
+  previousIndent = currentIndent;
+  previous = nodes.size() - 1;
+
+ }
+}
+
+
+// Moves each top-level "@template name" block out of nodes into a new MamlTemplate, renumbering the nodes left.
+void extractTemplates(std::vector<MamlNode>& nodes, std::vector<std::pair<Ogre::String, MamlTemplate*> >& templates)
+{
+ 
+ std::vector<MamlNode> kept;
+ std::vector<size_t> renumbered(nodes.size(), std::string::npos);
+ MamlTemplate* current = 0;
+ size_t currentRoot = std::string::npos;
+ 
+ for (size_t i=0;i < nodes.size();i++)
+ {
+  MamlNode node = nodes[i];
   
-  if (hasData)
+  if (node.parent == std::string::npos)
   {
-   elem->setText(elemData);
+   current = 0;
+   if (starts(node.selectors, "@template"))
+   {
+    current = new MamlTemplate();
+    currentRoot = i;
+    templates.push_back(std::pair<Ogre::String, MamlTemplate*>(trim_copy(slice_copy(node.selectors, 9)), current));
+    continue;
+   }
+  }
+  
+  if (current)
+  {
+   node.parent = node.parent == currentRoot ? std::string::npos : renumbered[node.parent];
+   renumbered[i] = current->nodes.size();
+   current->nodes.push_back(node);
+  }
+  else
+  {
+   node.parent = node.parent == std::string::npos ? std::string::npos : renumbered[node.parent];
+   renumbered[i] = kept.size();
+   kept.push_back(node);
   }
-
-  previousIndent = currentIndent;
-  previous = elem;
-
  }
+ 
+ nodes.swap(kept);
+ 
 }
 
-void PuzzleTree::loadCSS(const Ogre::String& css_file_name_path)
+// Replaces each {key} in string with params[key]; unknown keys are left as they are.
+String substitute(const String& string, const ElementArgs& params)
 {
  
- namespace S = ::Monkey::SecretMonkey;
+ if (params.empty() || has(string, '{') == false)
+  return string;
  
- S::StringPair sp;
- bool didCut = false;
- sp = S::cut(css_file_name_path, didCut, ':', 0);
+ String result;
+ size_t i = 0;
+ while (i < string.length())
+ {
+  size_t open = string.find('{', i), close = std::string::npos;
+  if (open != std::string::npos)
+   close = string.find('}', open);
+  if (close == std::string::npos)
+  {
+   result.append(string, i, std::string::npos);
+   break;
+  }
+  result.append(string, i, open - i);
+  ElementArgs::const_iterator it = params.find(string.substr(open + 1, close - open - 1));
+  if (it != params.end())
+   result.append((*it).second);
+  else
+   result.append(string, open, close - open + 1);
+  i = close + 1;
+ }
+ return result;
+ 
+}
 
- Ogre::DataStreamPtr stream;
- if (didCut)
-  stream = Ogre::ResourceGroupManager::getSingleton().openResource(sp.second, sp.first);
- else
-  stream = Ogre::ResourceGroupManager::getSingleton().openResource(css_file_name_path, Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME);
+
+// Reads a stylesheet into new styles, in the order of their rules, and the atlas it imports.
+// Touches no PuzzleTree, so it may run on any thread.
+// sources, if given, receives the declarations of each rule.
+void parseCSS(Ogre::DataStreamPtr stream, Ogre::String& atlas, std::vector<std::pair<Ogre::String, ElementStyle*> >& rules, std::vector<Ogre::String>* sources = 0)
+{
  
  Ogre::String line, element_name;
  Ogre::vector<Ogre::String>::type workings;
+ StringPair sp;
+ bool didCut = false;
  bool inElement = false;
  ElementStyle* style = 0;
  while (!stream->eof())
  {
   line = stream->getLine();
-  S::trim(line);
+  trim(line);
   if (line.length() == 0)
    continue;
-  if (S::starts(line, "//"))
+  if (starts(line, "//"))
    continue;
-  S::slice_to_first_of(line, Ogre::String("//"));
+  slice_to_first_of(line, Ogre::String("//"));
   
-  if (inElement == false && S::starts(line, "@import"))
+  if (inElement == false && starts(line, "@import"))
   {
-   S::slice_after_first_of(line, '"');
-   S::slice_after_first_of(line, '\'');
-   S::slice_to_last_of(line, '"');
-   S::slice_to_last_of(line, '\'');
-   S::trim(line);
-   mAtlas = line;
+   slice_after_first_of(line, '"');
+   slice_after_first_of(line, '\'');
+   slice_to_last_of(line, '"');
+   slice_to_last_of(line, '\'');
+   trim(line);
+   atlas = line;
    element_name.clear();
    continue;
   }
 
   if (inElement == false)
   {
-   size_t bracket = S::index(line, '{');
+   size_t bracket = index(line, '{');
    if (bracket != std::string::npos)
    {
     std::string t = line;
-    S::slice_to_first_of(t, '{');
+    slice_to_first_of(t, '{');
     element_name.append(t);
-    S::trim(element_name);
-    S::slice_after_first_of(line, '{');
+    trim(element_name);
+    slice_after_first_of(line, '{');
     style = new ElementStyle();
-    mStyles[element_name] = style;
+    rules.push_back(std::pair<Ogre::String, ElementStyle*>(element_name, style));
+    if (sources)
+     sources->push_back(Ogre::String());
     style->reset();
     inElement = true;
    }
@@ -934,25 +883,27 @@ void PuzzleTree::loadCSS(const Ogre::String& css_file_name_path)
   // In Element
 
   std::string working = line;
-  S::slice_to_first_of(working, '}');
+  slice_to_first_of(working, '}');
 
   // Parse CSS from working here.
-  S::trim(working);
+  trim(working);
+  if (sources)
+   sources->back().append(working + "\n");
 
   workings = Ogre::StringUtil::split(working, ";");
 
   for (size_t i=0;i < workings.size();i++)
   {
-   S::trim(workings[i]);
+   trim(workings[i]);
    if (workings[i].length() == 0)
     continue;
    
-   sp = S::cut(workings[i], didCut, ':', 0);
-   S::lower(sp.first);
+   sp = cut(workings[i], didCut, ':', 0);
+   lower(sp.first);
    style->from_css(sp.first, sp.second);
   }
   
-  if (S::index(line, '}') != std::string::npos)
+  if (index(line, '}') != std::string::npos)
   {
    inElement = false;
    element_name.clear();
@@ -962,971 +913,5150 @@ void PuzzleTree::loadCSS(const Ogre::String& css_file_name_path)
  
 }
 
-void PuzzleTree::dumpCSS()
+} // namespace SecretMonkey
+
+
+// -----------------------------------------------------------------------------------------
+
+
+PuzzleTree::PuzzleTree(const Ogre::String& css, Ogre::Viewport* viewport, Callback* callback)
+: mBackend(0),
+  mGorillaBackend(0),
+  mAtlasLoaded(false),
+  mCallback(callback),
+  mInputRecorder(0),
+  mLastEventElement(0),
+  mCurrentTextElement(0)
 {
- for (std::map<Ogre::String, ElementStyle*>::iterator it = mStyles.begin(); it != mStyles.end(); it++)
- {
-  Ogre::String css;
-  (*it).second->to_css(css);
- }
+ mGorillaBackend = new GorillaBackend(viewport);
+ mBackend = mGorillaBackend;
+ _construct(css, 0);
 }
 
-
-Element* PuzzleTree::createElement(const Ogre::String& css_id_or_classes, int type, const ElementArgs& args)
+PuzzleTree::PuzzleTree(const StyleSheet* sheet, Ogre::Viewport* viewport, Callback* callback)
+: mBackend(0),
+  mGorillaBackend(0),
+  mAtlasLoaded(false),
+  mCallback(callback),
+  mInputRecorder(0),
+  mLastEventElement(0),
+  mCurrentTextElement(0)
 {
- Gorilla::Layer* layer = 0;
- size_t index = 0;
- 
- if (type == ElementType_OSKContainer)
-  index = 13;
- else
-  index = 0;
- 
- Element* elem = new Element(css_id_or_classes, mLayers[index], this, 0, index, type, args);
- mElements.insert(std::pair<Ogre::String, Element*>(elem->getID(), elem));
- return elem;
+ mGorillaBackend = new GorillaBackend(viewport);
+ mBackend = mGorillaBackend;
+ _construct(Ogre::String(), sheet);
 }
 
+PuzzleTree::PuzzleTree(const StyleSheet* sheet, RenderBackend* backend, Callback* callback)
+: mBackend(backend),
+  mGorillaBackend(0),
+  mAtlasLoaded(false),
+  mCallback(callback),
+  mInputRecorder(0),
+  mLastEventElement(0),
+  mCurrentTextElement(0)
+{
+ _construct(Ogre::String(), sheet);
+}
 
-void PuzzleTree::dumpElements()
+PuzzleTree::PuzzleTree(const Ogre::String& css, RenderBackend* backend, Callback* callback)
+: mBackend(backend),
+  mGorillaBackend(0),
+  mAtlasLoaded(false),
+  mCallback(callback),
+  mInputRecorder(0),
+  mLastEventElement(0),
+  mCurrentTextElement(0)
 {
- for (std::multimap<Ogre::String, Element*>::iterator it = mElements.begin(); it != mElements.end(); it++)
- {
-  if ( (*it).second->hasParent() == false)
-   (*it).second->debug(0);
- }
+ _construct(css, 0);
 }
 
-void PuzzleTree::_checkMouse(const OIS::MouseEvent &arg, OIS::MouseButtonID id, int ois_event, ElementState state)
+void PuzzleTree::_construct(const Ogre::String& css, const StyleSheet* sheet)
 {
  
+ mCommands = new CommandQueue(4096, 65536);
+ mCascadeThreads = 1;
+ mCascadePool = 0;
+ mDeferCascade = false;
+ mInstantiationBudget = 2000;
+ mVeilNew = false;
+ mBufferEvents = false;
+ mDelivering = 0;
+ mStyleGeneration = 0;
+ mCascadeCount = 0;
+ mInotify = -1;
+ mStyleSheet = sheet;
+ mMousePointer = 0;
+ mHitBoxesDirty = true;
+ mNavDirty = true;
+ mNavScope = 0;
+ mNavFirst = 0;
+ 
+ mFrameStats.reset();
+ mFrameStats.parse.depth = mFrameStats.cascade.depth = mFrameStats.layout.depth = mFrameStats.input.depth = 0;
+ mLastFrameStats = mFrameStats;
+ 
+ mElementTypes[ElementType_Block] = "block";
+ mElementTypes[ElementType_Button] = "button";
+ mElementTypes[ElementType_TextBox] = "textbox";
+ mElementTypes[ElementType_List] = "list";
+ mElementTypes[ElementType_OSKContainer] = "osk";
+ mElementTypes[ElementType_OSKTitle] = "osk-title";
+ mElementTypes[ElementType_OSKInput] = "osk-input";
+ mElementTypes[ElementType_OSKSubmit] = "osk-submit";
+ mElementTypes[ElementType_OSKCancel] = "osk-cancel";
+ 
+ // Loads the atlas once the stylesheet's @import is known.
+ if (sheet)
+  _commitCSS(sheet->getAtlas(), std::vector<std::pair<Ogre::String, ElementStyle*> >(), Ogre::String());
+ else
+  loadCSS(css);
  
- Ogre::Vector2 coords(arg.state.X.abs, arg.state.Y.abs);
+ _stylePointer();
  
- mMousePointer->position(coords);
+ // The OSK is made on the first beginTextMode; see _requireOSK.
+ std::vector<std::pair<Ogre::String, MamlTemplate*> > templates;
+ mOSKTemplate = new MamlTemplate();
+ SecretMonkey::parseMaml(SecretMonkey::openResource("required.maml"), mElementTypes, mOSKTemplate->nodes);
+ SecretMonkey::extractTemplates(mOSKTemplate->nodes, templates);
+ _commitTemplates(templates);
+}
+
+bool PuzzleTree::_requireOSK()
+{
  
- Element* elem = 0;
- for (std::vector<Element*>::iterator it = mMouseListenerElements.begin(); it != mMouseListenerElements.end(); it++)
- {
-  elem = (*it)->intersectionTest(arg.state.X.abs, arg.state.Y.abs);
-  
-  if (elem != 0)
-  {
-    
-    if (mCurrentTextElement != 0)
-     if (elem->getType() < ElementType_OSK_BEGIN || elem->getType() > ElementType_OSK_END)
-      continue;
-    
-    if (elem->getState() != state)
-    {
-     if (mLastEventElement)
-      mLastEventElement->setState(ElementState_Normal);
-     elem->setState(state);
-     mLastEventElement = elem;
-     if (ois_event == 2)
-     {
-      if (elem->getType() == ElementType_TextBox)
-      {
-       beginTextMode(elem);
-      }
-      else if (elem->getType() == ElementType_OSKSubmit)
-      {
-       onKeySubmit();
-       return;
-      }
-      else if (elem->getType() == ElementType_OSKCancel)
-      {
-       onKeyCancel();
-       return;
-      }
-      else
-      {
-       mCallback->onElementActivated(mLastEventElement, arg.state);
-      }
-     }
-     else if (ois_event == 0)
-      mCallback->onElementFocused(mLastEventElement, arg.state);
-    }
-    
-   break;
-  } // if
- } // for
+ if (mSingletonElements.count(ElementType_OSKContainer))
+  return true;
  
- if (elem == 0 && mLastEventElement != 0)
+ MONKEY_TRACE("osk", "parse");
+ _instantiateTemplate(mOSKTemplate, 0, ElementArgs());
+ 
+ std::map<int, Element*>::iterator osk = mSingletonElements.find(ElementType_OSKContainer);
+ if (osk == mSingletonElements.end())
  {
-  mCallback->onElementBlur(mLastEventElement, arg.state);
-  mLastEventElement->setState(ElementState_Normal);
-  mLastEventElement = 0;
+  Ogre::LogManager::getSingleton().logMessage("Monkey: required.maml has no osk element");
+  return false;
  }
+ (*osk).second->hide();
+ return true;
+ 
 }
 
-void PuzzleTree::mouseMoved( const OIS::MouseEvent &arg )
+void PuzzleTree::pushScope(Element* root)
 {
- ElementState state = ElementState_Hover;
- if (arg.state.buttonDown(OIS::MB_Left))
-  state = ElementState_Active;
- _checkMouse(arg, OIS::MB_Button7, 0, state);
+ // Text mode ends unless its text box is inside the new scope.
+ Element* osk = _getSingleton(ElementType_OSKContainer);
+ if (mCurrentTextElement && root != osk && mCurrentTextElement->isDescendantOf(root) == false)
+  _cancelTextMode();
+ 
+ // Otherwise the OSK stays on top, so its buttons can still be reached.
+ if (mCurrentTextElement && osk && root != osk && mScopes.size() && mScopes.back() == osk)
+ {
+  mScopes.insert(mScopes.end() - 1, root);
+  return;
+ }
+ mScopes.push_back(root);
 }
 
-void PuzzleTree::mousePressed( const OIS::MouseEvent &arg, OIS::MouseButtonID id )
+void PuzzleTree::popScope()
 {
- _checkMouse(arg, id, 1, ElementState_Active);
+ if (mScopes.empty())
+  return;
+ if (mScopes.back() == _getSingleton(ElementType_OSKContainer))
+ {
+  _cancelTextMode();
+  return;
+ }
+ mScopes.pop_back();
 }
 
-void PuzzleTree::mouseReleased( const OIS::MouseEvent &arg, OIS::MouseButtonID id )
+void PuzzleTree::_removeScope(Element* root)
 {
- _checkMouse(arg, id, 2, ElementState_Hover);
+ if (mScopes.size() && mScopes.back() == root)
+  mScopes.pop_back();
+ else
+  mScopes.erase(std::remove(mScopes.begin(), mScopes.end(), root), mScopes.end());
 }
 
-void PuzzleTree::onKeyPress(char character)
+bool PuzzleTree::_inScope(Element* elem) const
 {
- if (mCurrentTextElement == 0)
-  return;
- mCurrentTextString.push_back(character);
- mSingletonElements[ElementType_OSKInput]->setText(mCurrentTextString + "|");
+ return mScopes.empty() || elem->isDescendantOf(mScopes.back());
 }
 
-void PuzzleTree::onKeyBackspace()
+Element* PuzzleTree::_getSingleton(int type) const
 {
- if (mCurrentTextElement == 0)
-  return;
- if (mCurrentTextString.length())
-  mCurrentTextString.pop_back();
- mSingletonElements[ElementType_OSKInput]->setText(mCurrentTextString + "|");
+ std::map<int, Element*>::const_iterator it = mSingletonElements.find(type);
+ return it == mSingletonElements.end() ? 0 : (*it).second;
 }
 
-void PuzzleTree::beginTextMode(Element* element)
+void PuzzleTree::_resolveNames(const ElementStyle& style, const Ogre::String& name)
 {
- namespace S = ::Monkey::SecretMonkey;
  
- endTextMode();
- mCurrentTextElement = element;
- mCurrentTextString = mCurrentTextElement->getText();
- mSingletonElements[ElementType_OSKTitle]->setText(mCurrentTextElement->getTitle());
- mSingletonElements[ElementType_OSKInput]->setText(mCurrentTextElement->getText() + "|");
- mSingletonElements[ElementType_OSKContainer]->show();
+ if (style.background.type == ElementStyle::Background::BT_Sprite && mSprites.count(style.background.sprite) == 0)
+ {
+  Gorilla::Sprite* sprite = mBackend->getSprite(style.background.sprite);
+  mSprites[style.background.sprite] = sprite;
+  if (sprite == 0)
+   Ogre::LogManager::getSingleton().logMessage("Monkey: Unknown sprite '" + style.background.sprite + "' used by '" + name + "' in atlas '" + mAtlas + "'");
+ }
+ 
+ if (mGlyphs.count(style.font) == 0)
+ {
+  Gorilla::GlyphData* glyphs = mBackend->getGlyphData(style.font);
+  mGlyphs[style.font] = glyphs;
+  if (glyphs == 0)
+   Ogre::LogManager::getSingleton().logMessage("Monkey: Unknown font '" + Ogre::StringConverter::toString(style.font) + "' used by '" + name + "' in atlas '" + mAtlas + "'");
+ }
+ 
 }
 
-void PuzzleTree::onKeySubmit()
+void PuzzleTree::_resolveStyle(ElementStyle* style, const Ogre::String& name)
 {
- endTextMode();
-}
-
-void PuzzleTree::onKeyCancel()
-{
- if (mCurrentTextElement)
+ 
+ // The names of loaded rules and the default font are known; others, i.e. from inline styles or a
+ // detached tree's own rules, are looked up once under the mutex as backends are not thread-safe.
+ if (style->background.type == ElementStyle::Background::BT_Sprite && style->background.sprite_data == 0)
  {
-  mSingletonElements[ElementType_OSKContainer]->hide();
-  mCurrentTextElement = 0;
+  std::map<Ogre::String, Gorilla::Sprite*>::const_iterator it = mSprites.find(style->background.sprite);
+  if (it != mSprites.end())
+   style->background.sprite_data = (*it).second;
+  else
+  {
+   std::lock_guard<std::mutex> lock(mResolveMutex);
+   std::map<Ogre::String, Gorilla::Sprite*>::iterator late = mLateSprites.find(style->background.sprite);
+   if (late == mLateSprites.end())
+   {
+    late = mLateSprites.insert(std::make_pair(style->background.sprite, mBackend->getSprite(style->background.sprite))).first;
+    if ((*late).second == 0)
+     Ogre::LogManager::getSingleton().logMessage("Monkey: Unknown sprite '" + style->background.sprite + "' used by '" + name + "' in atlas '" + mAtlas + "'");
+   }
+   style->background.sprite_data = (*late).second;
+  }
+  if (style->background.sprite_data == 0)
+   style->background.type = ElementStyle::Background::BT_Transparent;
+ }
+ 
+ if (style->glyph_data == 0)
+ {
+  std::map<size_t, Gorilla::GlyphData*>::const_iterator it = mGlyphs.find(style->font);
+  if (it != mGlyphs.end())
+   style->glyph_data = (*it).second;
+  else
+  {
+   std::lock_guard<std::mutex> lock(mResolveMutex);
+   std::map<size_t, Gorilla::GlyphData*>::iterator late = mLateGlyphs.find(style->font);
+   if (late == mLateGlyphs.end())
+   {
+    late = mLateGlyphs.insert(std::make_pair(style->font, mBackend->getGlyphData(style->font))).first;
+    if ((*late).second == 0)
+     Ogre::LogManager::getSingleton().logMessage("Monkey: Unknown font '" + Ogre::StringConverter::toString(style->font) + "' used by '" + name + "' in atlas '" + mAtlas + "'");
+   }
+   style->glyph_data = (*late).second;
+  }
  }
+ 
 }
 
-void PuzzleTree::endTextMode()
+void PuzzleTree::maml(const Ogre::String& maml_path)
 {
  
- if (mCurrentTextElement)
+ MONKEY_PROFILE(this, parse);
+ MONKEY_TRACE("maml", "parse", &maml_path);
+ 
+ std::vector<MamlNode> nodes;
+ std::vector<std::pair<Ogre::String, MamlTemplate*> > templates;
+ SecretMonkey::parseMaml(SecretMonkey::openResource(maml_path), mElementTypes, nodes);
+ SecretMonkey::extractTemplates(nodes, templates);
+ _commitTemplates(templates);
+ 
+ std::map<Ogre::String, MamlDocument*>::iterator it = mDocuments.find(maml_path);
+ if (it != mDocuments.end())
  {
-  mCurrentTextElement->setText(mCurrentTextString);
-  mSingletonElements[ElementType_OSKContainer]->hide();
-  mCallback->onTextboxChanged(mCurrentTextElement);
-  mCurrentTextElement = 0;
+  _reconcile((*it).second, nodes);
+  return;
  }
  
+ MamlDocument* document = new MamlDocument();
+ document->nodes = nodes;
+ mDocuments[maml_path] = document;
+ 
+ // Structure first, then a parallel cascade; see setCascadeThreads.
+ mDeferCascade = mCascadeThreads > 1;
+ 
+ std::vector<Element*> roots;
+ _buildMaml(nodes, false, roots, document);
+ 
+ if (mDeferCascade)
+ {
+  mDeferCascade = false;
+  _cascadeDeferred();
+ }
 }
 
-// ----------------------------------------------------------------------------------------------------------------
-
-void ElementStyle::reset()
+Instantiation* PuzzleTree::mamlIncremental(const Ogre::String& maml_path)
 {
- width = 1.0f;
- width_unit = Unit_Percent;
- width_set = false;
- height = 0.1f;
- height_unit = Unit_Percent;
- height_set = false;
- left = 0;
- left_unit = Unit_Pixel;
- left_set = false;
- top = 0;
- top_unit = Unit_Pixel;
- top_set = false;
- alignment.horz = Gorilla::TextAlign_Left;
- alignment.horz_set = false;
- alignment.vert = Gorilla::VerticalAlign_Top;
- alignment.vert_set = false;
- background.colour = Ogre::ColourValue::White;
- background.set = false;
- background.sprite.clear();
- background.type = Background::BT_Transparent;
- colour = Ogre::ColourValue::White;
- colour_set = false;
- font = 9;
- font_set = false;
- border.width = 0;
- border.width_set = false;
- border.left = Ogre::ColourValue::White;
- border.left_set = false;
- border.right= Ogre::ColourValue::White;
- border.right_set = false;
- border.bottom = Ogre::ColourValue::White;
- border.bottom_set = false;
- border.top = Ogre::ColourValue::White;
- border.top_set = false;
+ 
+ MONKEY_PROFILE(this, parse);
+ MONKEY_TRACE("maml", "parse", &maml_path);
+ 
+ Instantiation* instantiation = new Instantiation();
+ std::vector<std::pair<Ogre::String, MamlTemplate*> > templates;
+ SecretMonkey::parseMaml(SecretMonkey::openResource(maml_path), mElementTypes, instantiation->mNodes);
+ SecretMonkey::extractTemplates(instantiation->mNodes, templates);
+ _commitTemplates(templates);
+ instantiation->mElements.resize(instantiation->mNodes.size());
+ instantiation->mNext = 0;
+ mInstantiations.push_back(instantiation);
+ return instantiation;
+ 
 }
 
-void ElementStyle::to_css(Ogre::String& css)
+void PuzzleTree::destroyInstantiation(Instantiation* instantiation)
 {
- namespace S = ::Monkey::SecretMonkey;
- std::stringstream s;
-
- s << "left: " << left << ";\n"; // TODO: Units
- s << "top: " << top << ";\n"; // TODO: Units
- s << "width: " << width << ";\n"; // TODO: Units
- s << "height: " << height << ";\n"; // TODO: Units
+ 
+ std::vector<Instantiation*>::iterator it = std::find(mInstantiations.begin(), mInstantiations.end(), instantiation);
+ if (it == mInstantiations.end())
+  return;
+ mInstantiations.erase(it);
+ 
+ bool veil = mVeilNew;
+ mVeilNew = false;
+ for (size_t i=0;i < instantiation->mRoots.size();i++)
+  instantiation->mRoots[i]->_unveil();
+ mVeilNew = veil;
+ 
+ delete instantiation;
+ 
+}
 
- s << "text-align: ";
- if (alignment.horz == Gorilla::TextAlign_Right)
-  s << " right;\n";
- else if (alignment.horz == Gorilla::TextAlign_Centre)
-  s << " center;\n";
+void PuzzleTree::_instantiate()
+{
  
- s << "vertical-align: ";
- if (alignment.vert == Gorilla::VerticalAlign_Top)
-  s << " top;\n";
- else if (alignment.vert == Gorilla::VerticalAlign_Bottom)
-  s << " bottom;\n";
- else if (alignment.vert == Gorilla::VerticalAlign_Middle)
-  s << " middle;\n";
+ if (mInstantiations.empty())
+  return;
  
+ MONKEY_TRACE("instantiate", "parse");
  
-  s << "border-width: " << border.width << ";\n";
-  s << "border-top: " << S::toCSSRGBAColour(border.top)  << ";\n";
-  s << "border-right: " << S::toCSSRGBAColour(border.right)  << ";\n";
-  s << "border-bottom: " << S::toCSSRGBAColour(border.bottom)  << ";\n";
-  s << "border-top: " << S::toCSSRGBAColour(border.top)  << ";\n";
+ typedef std::chrono::high_resolution_clock Clock;
+ Clock::time_point start = Clock::now();
  
- if (background.type == Background::BT_Transparent)
-  s << "background: none;\n";
- else if (background.type == Background::BT_Sprite)
-  s << "background-image: " << background.sprite << ";\n";
- else if (background.type == Background::BT_Colour)
-  s << "background-colour: " << S::toCSSRGBAColour(background.colour) << ";\n";
+ mVeilNew = true;
+ 
+ bool first = true;
+ for (size_t n=0;n < mInstantiations.size();n++)
+ {
+  Instantiation* instantiation = mInstantiations[n];
+  if (instantiation->isComplete())
+   continue;
+  
+  while (instantiation->isComplete() == false)
+  {
+   if (first == false && std::chrono::duration<double, std::micro>(Clock::now() - start).count() >= mInstantiationBudget)
+   {
+    mVeilNew = false;
+    return;
+   }
+   first = false;
+   
+   size_t i = instantiation->mNext++;
+   const MamlNode& node = instantiation->mNodes[i];
+   Element* elem = 0;
+   if (node.parent != std::string::npos)
+   {
+    // The parent was destroyed, and its children with it.
+    if (instantiation->mElements[node.parent] == 0)
+     continue;
+    elem = instantiation->mElements[node.parent]->createChild(node.selectors, node.type, node.args);
+   }
+   else
+   {
+    elem = createElement(node.selectors, node.type, node.args);
+    instantiation->mRoots.push_back(elem);
+   }
+   if (node.has_text && elem->getText().empty())
+    elem->setText(node.text);
+   instantiation->mElements[i] = elem;
+  }
+  
+  // Everything is made; draw it.
+  mVeilNew = false;
+  for (size_t i=0;i < instantiation->mRoots.size();i++)
+   instantiation->mRoots[i]->_unveil();
+  mVeilNew = true;
+  
+  instantiation->mElements.clear();
+ }
+ 
+ mVeilNew = false;
  
- s << "colour: " << S::toCSSRGBAColour(colour) << ";\n";
- s << "font: " << font << ";\n";
-
- css.assign(s.str());
 }
 
-void ElementStyle::from_css(const Ogre::String& key, const Ogre::String& value)
+void PuzzleTree::_buildMaml(const std::vector<MamlNode>& nodes, bool detached, std::vector<Element*>& roots, MamlDocument* document)
 {
  
- namespace S = ::Monkey::SecretMonkey;
- Ogre::String working(value);
- S::trim(working);
-
- if (key == "width")
+ std::vector<Element*> built(nodes.size());
+ if (document)
+  document->elements.resize(nodes.size());
+ 
+ for (size_t i=0;i < nodes.size();i++)
  {
-  if (S::has(working, '%'))
+  const MamlNode& node = nodes[i];
+  Element* elem = 0;
+  
+  if (node.parent != std::string::npos)
+   elem = built[node.parent]->createChild(node.selectors, node.type, node.args);
+  else
   {
-   S::slice_to_first_of(working, '%');
-   width = Ogre::StringConverter::parseReal(working) * 0.01f;
-   width_unit = Unit_Percent;
-   width_set = true;
+   elem = _createElement(node.selectors, node.type, node.args, detached);
+   roots.push_back(elem);
   }
-  else if (S::has(working, 'p'))
+  
+  // A bound element's MAML text is only a placeholder for its observable.
+  if (node.has_text && elem->getText().empty())
+   elem->setText(node.text);
+  
+  built[i] = elem;
+  
+  if (document)
   {
-   S::slice_to_first_of(working, 'p');
-   width = Ogre::StringConverter::parseInt(working);
-   width_unit = Unit_Pixel;
-   width_set = true;
+   document->elements[i] = elem;
+   elem->mDocument = document;
+   elem->mDocumentNode = i;
   }
-  else
+ }
+ 
+}
+
+void PuzzleTree::_reconcile(MamlDocument* document, const std::vector<MamlNode>& nodes)
+{
+ 
+ MONKEY_TRACE("reconcile", "parse");
+ 
+ std::vector<std::vector<size_t> > before, after;
+ SecretMonkey::maml_children(document->nodes, before);
+ SecretMonkey::maml_children(nodes, after);
+ 
+ std::vector<Element*> elements(nodes.size(), 0);
+ _reconcileChildren(document, nodes, before, after, document->nodes.size(), nodes.size(), 0, elements);
+ 
+ // Numbered after every old element has been destroyed.
+ document->nodes = nodes;
+ document->elements.swap(elements);
+ for (size_t i=0;i < document->elements.size();i++)
+ {
+  document->elements[i]->mDocument = document;
+  document->elements[i]->mDocumentNode = i;
+ }
+ 
+}
+
+void PuzzleTree::_reconcileChildren(MamlDocument* document, const std::vector<MamlNode>& nodes, const std::vector<std::vector<size_t> >& before, const std::vector<std::vector<size_t> >& after, size_t before_parent, size_t after_parent, Element* parent, std::vector<Element*>& elements)
+{
+ 
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ static const std::vector<size_t> none;
+ const std::vector<size_t>& olds = before_parent == std::string::npos ? none : before[before_parent];
+ const std::vector<size_t>& news = after[after_parent];
+ 
+ std::vector<Ogre::String> oldIDs(olds.size()), newIDs(news.size());
+ for (size_t i=0;i < olds.size();i++)
+  oldIDs[i] = S::maml_id(document->nodes[olds[i]].selectors);
+ for (size_t i=0;i < news.size();i++)
+  newIDs[i] = S::maml_id(nodes[news[i]].selectors);
+ 
+ // By ID first, then in order among those without one.
+ std::vector<size_t> match(news.size(), std::string::npos);
+ std::vector<bool> taken(olds.size(), false);
+ for (size_t n=0;n < news.size();n++)
+ {
+  if (newIDs[n].empty())
+   continue;
+  for (size_t o=0;o < olds.size();o++)
   {
-   width = Ogre::StringConverter::parseInt(working);
-   width_unit = Unit_Pixel;
-   width_set = true;
+   if (taken[o] == false && oldIDs[o] == newIDs[n])
+   {
+    match[n] = o;
+    taken[o] = true;
+    break;
+   }
   }
  }
- else if (key == "height")
+ size_t next = 0;
+ for (size_t n=0;n < news.size();n++)
  {
-  if (S::has(working, '%'))
+  if (newIDs[n].length())
+   continue;
+  while (next < olds.size() && (taken[next] || oldIDs[next].length()))
+   next++;
+  if (next == olds.size())
+   break;
+  match[n] = next;
+  taken[next++] = true;
+ }
+ 
+ // A new type or arguments other than style means a new element.
+ for (size_t n=0;n < news.size();n++)
+ {
+  if (match[n] == std::string::npos)
+   continue;
+  const MamlNode& oldNode = document->nodes[olds[match[n]]];
+  const MamlNode& newNode = nodes[news[n]];
+  ElementArgs oldArgs = oldNode.args, newArgs = newNode.args;
+  oldArgs.erase("style");
+  newArgs.erase("style");
+  if (document->elements[olds[match[n]]] == 0 || oldNode.type != newNode.type || oldArgs != newArgs)
   {
-   S::slice_to_first_of(working, '%');
-   height = Ogre::StringConverter::parseReal(working) * 0.01;
-   height_unit = Unit_Percent;
-   height_set = true;
+   taken[match[n]] = false;
+   match[n] = std::string::npos;
   }
-  else if (S::has(working, 'p'))
+ }
+ 
+ for (size_t o=0;o < olds.size();o++)
+  if (taken[o] == false && document->elements[olds[o]])
+   destroyElement(document->elements[olds[o]]);
+ 
+ for (size_t n=0;n < news.size();n++)
+ {
+  const MamlNode& node = nodes[news[n]];
+  Element* elem = 0;
+  
+  if (match[n] == std::string::npos)
   {
-   S::slice_to_first_of(working, 'p');
-   height = Ogre::StringConverter::parseInt(working);
-   height_unit = Unit_Pixel;
-   height_set = true;
+   elem = parent ? parent->createChild(node.selectors, node.type, node.args) : _createElement(node.selectors, node.type, node.args, false);
+   if (node.has_text && elem->getText().empty())
+    elem->setText(node.text);
   }
   else
   {
-   height = Ogre::StringConverter::parseInt(working);
-   height_unit = Unit_Pixel;
-   height_set = true;
+   const MamlNode& oldNode = document->nodes[olds[match[n]]];
+   elem = document->elements[olds[match[n]]];
+   
+   // Compared with the last revision, so changes made since by the application are kept.
+   Ogre::String style = S::args_get(node.args, "style");
+   if (oldNode.selectors != node.selectors || style != elem->mInlineStyle)
+   {
+    elem->_parseSelectors(node.selectors);
+    elem->mInlineStyle = style;
+    elem->restyle();
+   }
+   
+   if (elem->mBinding.empty() && (oldNode.has_text != node.has_text || oldNode.text != node.text))
+    elem->setText(node.has_text ? node.text : Ogre::String());
   }
+  
+  elements[news[n]] = elem;
+  _reconcileChildren(document, nodes, before, after, match[n] == std::string::npos ? std::string::npos : olds[match[n]], news[n], elem, elements);
  }
- else if (key == "left")
+ 
+}
+
+void PuzzleTree::loadCSS(const Ogre::String& css_file_name_path)
+{
+ 
+ MONKEY_PROFILE(this, parse);
+ MONKEY_TRACE("loadCSS", "parse", &css_file_name_path);
+ 
+ Ogre::String atlas;
+ std::vector<std::pair<Ogre::String, ElementStyle*> > rules;
+ SecretMonkey::parseCSS(SecretMonkey::openResource(css_file_name_path), atlas, rules);
+ _commitCSS(atlas, rules, css_file_name_path);
+ 
+}
+
+void PuzzleTree::_commitCSS(const Ogre::String& atlas, const std::vector<std::pair<Ogre::String, ElementStyle*> >& rules, const Ogre::String& file)
+{
+ 
+ if (atlas.length())
+  mAtlas = atlas;
+ 
+ for (size_t i=0;i < rules.size();i++)
  {
-  if (S::isInteger(working) == false)
+  ElementStyle*& style = mStyles[rules[i].first];
+  if (style != rules[i].second)
+   delete style;
+  style = rules[i].second;
+  mStyleFiles[rules[i].first] = file;
+ }
+ 
+ // Compiled templates hold looks cascaded with the old rules.
+ mStyleGeneration++;
+ 
+ if (mAtlasLoaded == false)
+ {
+  mBackend->loadAtlas(mAtlas);
+  mAtlasLoaded = true;
+  
+  ElementStyle defaults;
+  defaults.reset();
+  _resolveNames(defaults, "(default)");
+  if (mStyleSheet)
+   for (std::map<Ogre::String, ElementStyle*>::const_iterator it = mStyleSheet->mStyles.begin(); it != mStyleSheet->mStyles.end(); it++)
+    _resolveNames(*(*it).second, (*it).first);
+ }
+ 
+ // Sprites and fonts are looked up once here, so unknown names are reported on load rather than on every cascade.
+ for (size_t i=0;i < rules.size();i++)
+ {
+  _resolveNames(*rules[i].second, rules[i].first);
+  _resolveStyle(rules[i].second, rules[i].first);
+ }
+ 
+}
+
+void PuzzleTree::_stylePointer()
+{
+ 
+ // Shared rules are unresolved, so the pointer's look is resolved here.
+ ElementStyle pointer;
+ const ElementStyle* style = _findStyle("mousepointer");
+ if (style)
+ {
+  pointer = *style;
+  _resolveStyle(&pointer, "mousepointer");
+  style = &pointer;
+ }
+ 
+ if (style == 0)
+ {
+  if (mMousePointer == 0)
+   mMousePointer = _createRectangle(15, 0,0,32,32);
+  else
   {
-   // see if it has a modifier; px or %, if not, see if it matches left, center, left
-   if (working == "right")
-   {
-    left = 0;
-    left_unit = Unit_AlignRight;
-    left_set = true;
-   }
-   else if (working == "left")
-   {
-    left = 0;
-    left_unit = Unit_Pixel;
-    left_set = true;
-   }
-   else if (working == "center" || working == "centre")
-   {
-    left = 0;
-    left_unit = Unit_AlignCenter;
-    left_set = true;
-   }
-   else if (S::has(working, '%'))
-   {
-    S::slice_to_first_of(working, '%');
-    left = Ogre::StringConverter::parseReal(working) * 0.01;;
-    left_unit = Unit_Percent;
-    left_set = true;
-   }
-   else if (S::has(working, 'p'))
+   mMousePointer->size(32, 32);
+   mMousePointer->no_background();
+   mMousePointer->no_border();
+  }
+  return;
+ }
+ 
+ float x = style->left,
+       y = style->top,
+       w = style->width,
+       h = style->height,
+       screenW = mBackend->getWidth(),
+       screenH = mBackend->getHeight();
+ 
+ if (style->left_unit == Unit_Percent)
+  x *= screenW;
+ if (style->top_unit == Unit_Percent)
+  y *= screenH;
+ if (style->width_unit == Unit_Percent)
+  w *= screenW;
+ if (style->height_unit == Unit_Percent)
+  h *= screenH;
+ 
+ // A restyled pointer stays where the mouse is.
+ if (mMousePointer == 0)
+  mMousePointer = _createRectangle(15, x,y,w,h);
+ else
+  mMousePointer->size(w, h);
+ 
+ if (style->background.type == ElementStyle::Background::BT_Colour)
+  mMousePointer->background_colour(style->background.colour);
+ else if (style->background.type == ElementStyle::Background::BT_Sprite)
+  mMousePointer->background_image(style->background.sprite_data);
+ else
+  mMousePointer->no_background();
+ 
+ if (style->border.width == 0)
+  mMousePointer->no_border();
+ else
+  mMousePointer->border(style->border.width, style->border.top, style->border.right, style->border.bottom, style->border.left);
+ 
+}
+
+bool PuzzleTree::watchCSS(const Ogre::String& css_file_name_path)
+{
+ 
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ bool didCut = false;
+ S::StringPair sp = S::cut(css_file_name_path, didCut, ':', 0);
+ Ogre::FileInfoListPtr files = Ogre::ResourceGroupManager::getSingleton().findResourceFileInfo(didCut ? sp.first : Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME, didCut ? sp.second : css_file_name_path);
+ if (files->empty() || files->front().archive->getType() != "FileSystem")
+ {
+  Ogre::LogManager::getSingleton().logMessage("Monkey: Cannot watch '" + css_file_name_path + "', it is not in a FileSystem resource location");
+  return false;
+ }
+ 
+ unwatchCSS(css_file_name_path);
+ 
+ WatchedCSS watched;
+ watched.resource = css_file_name_path;
+ watched.path = files->front().archive->getName() + "/" + files->front().filename;
+ size_t slash = watched.path.find_last_of("/\\");
+ watched.file = watched.path.substr(slash + 1);
+ watched.watch = -1;
+ watched.modified = 0;
+ 
+ struct stat info;
+ if (stat(watched.path.c_str(), &info) == 0)
+  watched.modified = info.st_mtime;
+ 
+#ifdef __linux__
+ if (mInotify == -1)
+  mInotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+ // The directory, as editors often save by renaming a new file over the old one.
+ if (mInotify != -1)
+  watched.watch = inotify_add_watch(mInotify, watched.path.substr(0, slash).c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+#endif
+ 
+ _reloadCSS(watched);
+ mWatchedCSS.push_back(watched);
+ return true;
+ 
+}
+
+void PuzzleTree::unwatchCSS(const Ogre::String& css_file_name_path)
+{
+ 
+ for (size_t i=0;i < mWatchedCSS.size();i++)
+ {
+  if (mWatchedCSS[i].resource != css_file_name_path)
+   continue;
+  
+  int watch = mWatchedCSS[i].watch;
+  mWatchedCSS.erase(mWatchedCSS.begin() + i);
+  
+#ifdef __linux__
+  // Files in the same directory share a watch.
+  for (size_t j=0;j < mWatchedCSS.size();j++)
+   if (mWatchedCSS[j].watch == watch)
+    watch = -1;
+  if (watch != -1)
+   inotify_rm_watch(mInotify, watch);
+#endif
+  return;
+ }
+ 
+}
+
+void PuzzleTree::_checkWatchedCSS()
+{
+ 
+ if (mWatchedCSS.empty())
+  return;
+ 
+ std::vector<bool> changed(mWatchedCSS.size(), false);
+ 
+#ifdef __linux__
+ if (mInotify != -1)
+ {
+  alignas(inotify_event) char buffer[4096];
+  ssize_t length = 0;
+  while ((length = read(mInotify, buffer, sizeof(buffer))) > 0)
+  {
+   for (char* it = buffer; it < buffer + length; it += sizeof(inotify_event) + ((inotify_event*) it)->len)
    {
-    S::slice_to_first_of(working, 'p');
-    left = Ogre::StringConverter::parseInt(working);
-    left_unit = Unit_Pixel;
-    left_set = true;
+    const inotify_event* event = (const inotify_event*) it;
+    for (size_t i=0;i < mWatchedCSS.size();i++)
+     if (event->len && mWatchedCSS[i].watch == event->wd && mWatchedCSS[i].file == event->name)
+      changed[i] = true;
    }
   }
+ }
+#endif
+ 
+ // Without inotify the modification times are compared instead.
+ for (size_t i=0;i < mWatchedCSS.size();i++)
+ {
+  if (mWatchedCSS[i].watch != -1)
+   continue;
+  struct stat info;
+  if (stat(mWatchedCSS[i].path.c_str(), &info) == 0 && info.st_mtime != mWatchedCSS[i].modified)
+  {
+   mWatchedCSS[i].modified = info.st_mtime;
+   changed[i] = true;
+  }
+ }
+ 
+ for (size_t i=0;i < mWatchedCSS.size();i++)
+  if (changed[i])
+   _reloadCSS(mWatchedCSS[i]);
+ 
+}
+
+void PuzzleTree::_reloadCSS(WatchedCSS& watched)
+{
+ 
+ MONKEY_PROFILE(this, parse);
+ MONKEY_TRACE("reloadCSS", "parse", &watched.resource);
+ 
+ Ogre::String atlas;
+ std::vector<std::pair<Ogre::String, ElementStyle*> > rules;
+ std::vector<Ogre::String> sources;
+ SecretMonkey::parseCSS(SecretMonkey::openResource(watched.resource), atlas, rules, &sources);
+ 
+ if (atlas.length() && atlas != mAtlas)
+  Ogre::LogManager::getSingleton().logMessage("Monkey: '" + watched.resource + "' imports atlas '" + atlas + "'; only '" + mAtlas + "' is loaded");
+ 
+ // The last rule of a name wins, as in loadCSS.
+ std::map<Ogre::String, size_t> last;
+ for (size_t i=0;i < rules.size();i++)
+  last[rules[i].first] = i;
+ 
+ std::set<Ogre::String> names;
+ std::map<Ogre::String, Ogre::String> current;
+ std::vector<std::pair<Ogre::String, ElementStyle*> > changed;
+ for (size_t i=0;i < rules.size();i++)
+ {
+  const Ogre::String& name = rules[i].first;
+  std::map<Ogre::String, Ogre::String>::iterator before = watched.rules.find(name);
+  if (last[name] != i || (before != watched.rules.end() && (*before).second == sources[i]))
+  {
+   if (last[name] == i)
+    current[name] = sources[i];
+   delete rules[i].second;
+   continue;
+  }
+  current[name] = sources[i];
+  changed.push_back(rules[i]);
+  names.insert(name);
+ }
+ 
+ for (std::map<Ogre::String, Ogre::String>::iterator it = watched.rules.begin(); it != watched.rules.end(); it++)
+ {
+  // Left alone if another stylesheet has since replaced it.
+  if (current.count((*it).first) || mStyleFiles[(*it).first] != watched.resource)
+   continue;
+  std::map<Ogre::String, ElementStyle*>::iterator style = mStyles.find((*it).first);
+  if (style != mStyles.end())
+  {
+   delete (*style).second;
+   mStyles.erase(style);
+  }
+  mStyleFiles.erase((*it).first);
+  names.insert((*it).first);
+ }
+ 
+ watched.rules.swap(current);
+ 
+ if (names.empty())
+  return;
+ 
+ _commitCSS(mAtlasLoaded ? Ogre::String() : atlas, changed, watched.resource);
+ 
+ if (names.count("mousepointer"))
+  _stylePointer();
+ 
+ std::vector<Element*> roots;
+ for (std::multimap<Ogre::String, Element*>::iterator it = mElements.begin(); it != mElements.end(); it++)
+  if ((*it).second->getParent() == 0)
+   roots.push_back((*it).second);
+ for (size_t i=0;i < roots.size();i++)
+  roots[i]->_restyleUsing(names);
+ 
+}
+
+StyleSheet::StyleSheet(const Ogre::String& css_file_name_path)
+{
+ 
+ MONKEY_TRACE("loadCSS", "parse", &css_file_name_path);
+ 
+ std::vector<std::pair<Ogre::String, ElementStyle*> > rules;
+ SecretMonkey::parseCSS(SecretMonkey::openResource(css_file_name_path), mAtlas, rules);
+ 
+ // The last rule of a name wins, as in PuzzleTree::loadCSS.
+ for (size_t i=0;i < rules.size();i++)
+ {
+  ElementStyle*& style = mStyles[rules[i].first];
+  delete style;
+  style = rules[i].second;
+ }
+ 
+}
+
+StyleSheet::~StyleSheet()
+{
+ for (std::map<Ogre::String, ElementStyle*>::iterator it = mStyles.begin(); it != mStyles.end(); it++)
+  delete (*it).second;
+}
+
+const ElementStyle* StyleSheet::getStyle(const Ogre::String& name) const
+{
+ std::map<Ogre::String, ElementStyle*>::const_iterator it = mStyles.find(name);
+ if (it == mStyles.end())
+  return 0;
+ return (*it).second;
+}
+
+void PuzzleTree::_commitTemplates(const std::vector<std::pair<Ogre::String, MamlTemplate*> >& templates)
+{
+ for (size_t i=0;i < templates.size();i++)
+ {
+  MamlTemplate*& tmpl = mTemplates[templates[i].first];
+  delete tmpl;
+  tmpl = templates[i].second;
+ }
+}
+
+void PuzzleTree::_compileTemplate(MamlTemplate* tmpl, Element* parent)
+{
+ 
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ MONKEY_PROFILE(this, cascade);
+ 
+ for (size_t i=0;i < tmpl->looks.size();i++)
+  delete tmpl->looks[i];
+ tmpl->looks.assign(tmpl->nodes.size(), 0);
+ 
+ std::vector<Element*> made(tmpl->nodes.size(), 0);
+ for (size_t i=0;i < tmpl->nodes.size();i++)
+ {
+  const MamlNode& node = tmpl->nodes[i];
+  Element* into = node.parent == std::string::npos ? parent : made[node.parent];
+  if (node.parent != std::string::npos && into == 0)
+   continue;
+  if (S::has(node.selectors, '{') || S::has(S::args_get(node.args, "style"), '{'))
+   continue;
+  
+  // Detached and not linked into its parent, so it is cascaded but neither registered nor laid out.
+  Element* elem = new Element(node.selectors, this, into, 0, node.type, node.args, true);
+  TemplateLook* look = new TemplateLook();
+  look->styles = elem->mStyles;
+  look->id = elem->mID;
+  look->normal = elem->mLookNormal;
+  look->active = elem->mLookActive;
+  look->hover = elem->mLookHover;
+  tmpl->looks[i] = look;
+  made[i] = elem;
+ }
+ 
+ // Children first.
+ for (size_t i=made.size();i-- > 0;)
+  delete made[i];
+ 
+ tmpl->generation = mStyleGeneration;
+ tmpl->parent = parent;
+ tmpl->parent_stamp = parent ? parent->mCascadeStamp : 0;
+ 
+}
+
+Element* PuzzleTree::instantiate(const Ogre::String& name, Element* parent, const ElementArgs& params)
+{
+ 
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ std::map<Ogre::String, MamlTemplate*>::iterator it = mTemplates.find(name);
+ if (it == mTemplates.end())
+ {
+  Ogre::LogManager::getSingleton().logMessage("Monkey: Unknown template '" + name + "'");
+  return 0;
+ }
+ 
+ MONKEY_TRACE("instantiate", "parse", &name);
+ 
+ return _instantiateTemplate((*it).second, parent, params);
+ 
+}
+
+Element* PuzzleTree::_instantiateTemplate(MamlTemplate* tmpl, Element* parent, const ElementArgs& params)
+{
+ 
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ if (tmpl->generation != mStyleGeneration || tmpl->parent != parent || tmpl->parent_stamp != (parent ? parent->mCascadeStamp : 0))
+  _compileTemplate(tmpl, parent);
+ 
+ std::vector<Element*> built(tmpl->nodes.size());
+ for (size_t i=0;i < tmpl->nodes.size();i++)
+ {
+  const MamlNode& node = tmpl->nodes[i];
+  
+  ElementArgs args = node.args;
+  for (ElementArgs::iterator arg = args.begin(); arg != args.end(); arg++)
+   (*arg).second = S::substitute((*arg).second, params);
+  
+  Element* into = node.parent == std::string::npos ? parent : built[node.parent];
+  Element* elem = 0;
+  if (into)
+   elem = into->_createChild(S::substitute(node.selectors, params), node.type, args, tmpl->looks[i]);
   else
+   elem = _createElement(S::substitute(node.selectors, params), node.type, args, false, tmpl->looks[i]);
+  
+  if (node.has_text && elem->getText().empty())
+   elem->setText(S::substitute(node.text, params));
+  
+  built[i] = elem;
+ }
+ 
+ return built.empty() ? 0 : built[0];
+ 
+}
+
+void PuzzleTree::dumpCSS()
+{
+ for (std::map<Ogre::String, ElementStyle*>::iterator it = mStyles.begin(); it != mStyles.end(); it++)
+ {
+  Ogre::String css;
+  (*it).second->to_css(css);
+ }
+}
+
+
+Element* PuzzleTree::createElement(const Ogre::String& css_id_or_classes, int type, const ElementArgs& args)
+{
+ return _createElement(css_id_or_classes, type, args, false);
+}
+
+void PuzzleTree::destroyElement(Element* element)
+{
+ delete element;
+}
+
+Element* PuzzleTree::_createElement(const Ogre::String& css_id_or_classes, int type, const ElementArgs& args, bool detached, const TemplateLook* look)
+{
+ size_t index = 0;
+ 
+ if (type == ElementType_OSKContainer)
+  index = 13;
+ else
+  index = 0;
+ 
+ Element* elem = new Element(css_id_or_classes, this, 0, index, type, args, detached, look);
+ if (detached == false)
+  mElements.insert(std::pair<Ogre::String, Element*>(elem->getID(), elem));
+ return elem;
+}
+
+
+void PuzzleTree::_forgetElement(Element* elem)
+{
+ 
+ std::pair<std::multimap<Ogre::String, Element*>::iterator, std::multimap<Ogre::String, Element*>::iterator> range = mElements.equal_range(elem->getID());
+ for (std::multimap<Ogre::String, Element*>::iterator it = range.first; it != range.second; it++)
+ {
+  if ((*it).second == elem)
   {
-   left = Ogre::StringConverter::parseInt(working);
-   left_unit = Unit_Pixel;
-   left_set = true;
+   mElements.erase(it);
+   break;
   }
  }
- else if (key == "top")
+ 
+ mMouseListenerElements.erase(std::remove(mMouseListenerElements.begin(), mMouseListenerElements.end(), elem), mMouseListenerElements.end());
+ mListElements.erase(std::remove(mListElements.begin(), mListElements.end(), elem), mListElements.end());
+ 
+ std::map<int, Element*>::iterator singleton = mSingletonElements.find(elem->getType());
+ if (singleton != mSingletonElements.end() && (*singleton).second == elem)
+  mSingletonElements.erase(singleton);
+ 
+ if (mLastEventElement == elem)
+  mLastEventElement = 0;
+ 
+ _removeScope(elem);
+ 
+ for (Delivery* delivery = mDelivering; delivery; delivery = delivery->outer)
+  if (delivery->element == elem)
+   delivery->destroyed = true;
+ 
+ mHitBoxesDirty = true;
+ 
+ if (elem->mDocument)
+  elem->mDocument->elements[elem->mDocumentNode] = 0;
+
+ for (size_t i=0;i < mInstantiations.size();i++)
  {
-  if (S::isInteger(working) == false)
+  Instantiation* instantiation = mInstantiations[i];
+  std::replace(instantiation->mElements.begin(), instantiation->mElements.end(), elem, (Element*) 0);
+  instantiation->mRoots.erase(std::remove(instantiation->mRoots.begin(), instantiation->mRoots.end(), elem), instantiation->mRoots.end());
+ }
+ 
+ for (size_t i=0;i < mEvents.size();i++)
+  if (mEvents[i].element == elem)
+   mEvents[i].element = 0;
+ for (size_t i=0;i < mPolledEvents.size();i++)
+  if (mPolledEvents[i].element == elem)
+   mPolledEvents[i].element = 0;
+ 
+ _unbind(elem);
+ 
+ // Leave text mode without submitting the text.
+ if (mCurrentTextElement == elem)
+ {
+  mCurrentTextElement = 0;
+  if (Element* osk = _getSingleton(ElementType_OSKContainer))
   {
-   // see if it has a modifier; px or %, if not, see if it matches top, center, top
-   if (working == "right" || working == "bottom")
-   {
-    top = 0;
-    top_unit = Unit_AlignRight;
-    top_set = true;
-   }
-   else if (working == "top")
-   {
-    top = 0;
-    top_unit = Unit_Pixel;
-    top_set = true;
-   }
-   else if (working == "center" || working == "centre" || working == "middle")
-   {
-    top = 0;
-    top_unit = Unit_AlignCenter;
-    top_set = true;
+   osk->hide();
+   _removeScope(osk);
+  }
+ }
+ 
+}
+
+void PuzzleTree::dumpElements()
+{
+ for (std::multimap<Ogre::String, Element*>::iterator it = mElements.begin(); it != mElements.end(); it++)
+ {
+  if ( (*it).second->hasParent() == false)
+   (*it).second->debug(0);
+ }
+}
+
+void PuzzleTree::getMemoryReport(MemoryReport& report) const
+{
+ 
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ report = MemoryReport();
+ MemoryUsage& tree = report.tree;
+ 
+ tree.elements += sizeof(PuzzleTree);
+ 
+ for (std::map<Ogre::String, ElementStyle*>::const_iterator it = mStyles.begin(); it != mStyles.end(); it++)
+ {
+  tree.styles += sizeof(ElementStyle);
+  tree.containers += S::mapNodeBytes<std::pair<const Ogre::String, ElementStyle*> >();
+  tree.strings += S::stringBytes((*it).first) + S::styleStringBytes(*(*it).second);
+ }
+ 
+ for (std::map<int, std::string>::const_iterator it = mElementTypes.begin(); it != mElementTypes.end(); it++)
+ {
+  tree.containers += S::mapNodeBytes<std::pair<const int, std::string> >();
+  tree.strings += S::stringBytes((*it).second);
+ }
+ 
+ tree.containers += mSingletonElements.size() * S::mapNodeBytes<std::pair<const int, Element*> >();
+ tree.containers += mListElements.capacity() * sizeof(Element*);
+ tree.containers += mHitBoxes.capacity() * sizeof(HitBox);
+ tree.containers += mCommands->getBytes();
+ 
+ for (std::map<Ogre::String, Binding>::const_iterator it = mBindings.begin(); it != mBindings.end(); it++)
+ {
+  tree.containers += S::mapNodeBytes<std::pair<const Ogre::String, Binding> >();
+  tree.containers += ((*it).second.text.capacity() + (*it).second.classes.capacity()) * sizeof(Element*);
+  tree.strings += S::stringBytes((*it).first);
+ }
+ 
+ tree.listeners += (mMouseListenerElements.capacity() - mMouseListenerElements.size()) * sizeof(Element*);
+ tree.strings += S::stringBytes(mAtlas) + S::stringBytes(mCurrentTextString);
+ 
+ if (mMousePointer)
+  tree.primitives += mBackend->getPrimitiveBytes(mMousePointer);
+ 
+ report.total = tree;
+ 
+ for (std::multimap<Ogre::String, Element*>::const_iterator it = mElements.begin(); it != mElements.end(); it++)
+ {
+  if ((*it).second->hasParent())
+   continue;
+  MemoryUsage usage;
+  (*it).second->getMemoryUsage(usage);
+  report.elements.push_back(std::pair<Ogre::String, MemoryUsage>((*it).first, usage));
+  report.total += usage;
+ }
+ 
+}
+
+void PuzzleTree::dumpMemory() const
+{
+ MemoryReport report;
+ getMemoryReport(report);
+ 
+ std::cout << "name,elements,looks,styles,strings,containers,listeners,primitives,total\n";
+ 
+ for (size_t i=0;i <= report.elements.size() + 1;i++)
+ {
+  const MemoryUsage* usage = 0;
+  if (i == 0)
+  {
+   std::cout << "(tree)";
+   usage = &report.tree;
+  }
+  else if (i <= report.elements.size())
+  {
+   std::cout << (report.elements[i-1].first.length() ? report.elements[i-1].first : "(anonymous)");
+   usage = &report.elements[i-1].second;
+  }
+  else
+  {
+   std::cout << "(total)";
+   usage = &report.total;
+  }
+  std::cout << "," << usage->elements << "," << usage->looks << "," << usage->styles << "," << usage->strings
+            << "," << usage->containers << "," << usage->listeners << "," << usage->primitives << "," << usage->total() << "\n";
+ }
+}
+
+void PuzzleTree::_checkMouse(const OIS::MouseEvent &arg, OIS::MouseButtonID id, int ois_event, ElementState state)
+{
+ 
+ MONKEY_PROFILE(this, input);
+ MONKEY_TRACE("mouse", "input");
+ mFrameStats.hit_tests++;
+ 
+ 
+ mMousePointer->position(arg.state.X.abs, arg.state.Y.abs);
+ 
+ if (mHitBoxesDirty)
+  _buildHitBoxes();
+ 
+ // Only the top scope's boxes are tested; a hidden scope has none.
+ size_t begin = 0, end = mHitBoxes.size();
+ if (mScopes.size())
+ {
+  Element* scope = mScopes.back();
+  if (scope->mHitBox < mHitBoxes.size() && mHitBoxes[scope->mHitBox].element == scope)
+  {
+   begin = scope->mHitBox;
+   end = mHitBoxes[begin].end;
+  }
+  else
+   begin = end;
+ }
+ 
+ Element* elem = _hitTest(arg.state.X.abs, arg.state.Y.abs, begin, end);
+ 
+ if (elem != 0)
+ {
+  if (elem->getState() != state)
+  {
+   if (mLastEventElement)
+    mLastEventElement->setState(ElementState_Normal);
+   elem->setState(state);
+   mLastEventElement = elem;
+   if (ois_event == 2)
+   {
+    if (_activate(elem, &arg.state) == false)
+     return;
    }
-   else if (S::has(working, '%'))
+   else if (ois_event == 0)
    {
-    S::slice_to_first_of(working, '%');
-    top = Ogre::StringConverter::parseReal(working) * 0.01;
-    top_unit = Unit_Percent;
-    top_set = true;
+    _fire(ElementEvent_Focused, mLastEventElement, &arg.state);
    }
-   else if (S::has(working, 'p'))
+  }
+ }
+ 
+ if (elem == 0 && mLastEventElement != 0)
+ {
+  _fire(ElementEvent_Blur, mLastEventElement, &arg.state);
+  // The callback may have destroyed it.
+  if (mLastEventElement)
+   mLastEventElement->setState(ElementState_Normal);
+  mLastEventElement = 0;
+ }
+}
+
+void PuzzleTree::_buildHitBoxes()
+{
+ 
+ MONKEY_TRACE("hitboxes", "input");
+ 
+ mHitBoxes.clear();
+ for (std::multimap<Ogre::String, Element*>::iterator it = mElements.begin(); it != mElements.end(); it++)
+  if ((*it).second->getParent() == 0)
+   _addHitBoxes((*it).second, false, 0);
+ mHitBoxesDirty = false;
+ mNavDirty = true;
+ 
+}
+
+void PuzzleTree::_addHitBoxes(Element* elem, bool listened, size_t depth)
+{
+ 
+ if (elem->mIsVisible == false || elem->mCulled || elem->mVeiled || elem->mRecordsValid == false)
+  return;
+ 
+ size_t index = mHitBoxes.size();
+ mHitBoxes.push_back(HitBox());
+ elem->mHitBox = index;
+ listened = listened || elem->mListening;
+ 
+ HitBox box;
+ _boxHit(elem, listened, box);
+ box.depth = depth;
+ box.interactive = box.target;
+ box.reach_left = box.left;
+ box.reach_top = box.top;
+ box.reach_right = box.right;
+ box.reach_bottom = box.bottom;
+ 
+ for (std::multimap<Ogre::String, Element*>::iterator it = elem->mChildren.begin(); it != elem->mChildren.end(); it++)
+ {
+  size_t child = mHitBoxes.size();
+  _addHitBoxes((*it).second, listened, depth + 1);
+  if (child == mHitBoxes.size() || mHitBoxes[child].interactive == false)
+   continue;
+  const HitBox& reach = mHitBoxes[child];
+  if (box.interactive)
+  {
+   box.reach_left = std::min(box.reach_left, reach.reach_left);
+   box.reach_top = std::min(box.reach_top, reach.reach_top);
+   box.reach_right = std::max(box.reach_right, reach.reach_right);
+   box.reach_bottom = std::max(box.reach_bottom, reach.reach_bottom);
+  }
+  else
+  {
+   box.reach_left = reach.reach_left;
+   box.reach_top = reach.reach_top;
+   box.reach_right = reach.reach_right;
+   box.reach_bottom = reach.reach_bottom;
+   box.interactive = true;
+  }
+ }
+ 
+ box.end = mHitBoxes.size();
+ mHitBoxes[index] = box;
+ 
+}
+
+void PuzzleTree::_boxHit(Element* elem, bool listened, HitBox& box) const
+{
+ 
+ const RenderRecord& record = elem->mRecords[elem->mState];
+ box.left = std::max(record.left, elem->mClip.left);
+ box.top = std::max(record.top, elem->mClip.top);
+ box.right = std::min(record.left + record.width, elem->mClip.right);
+ box.bottom = std::min(record.top + record.height, elem->mClip.bottom);
+ box.element = elem;
+ box.listened = listened;
+ box.target = listened && elem->mLookNormal.pointer_events && (elem->mListening || elem->mRectangle) && box.left < box.right && box.top < box.bottom;
+ 
+}
+
+void PuzzleTree::_touchHitBox(Element* elem)
+{
+ 
+ if (mHitBoxesDirty)
+  return;
+ 
+ bool boxed = elem->mIsVisible && elem->mCulled == false && elem->mVeiled == false && elem->mRecordsValid;
+ if (elem->mHitBox >= mHitBoxes.size() || mHitBoxes[elem->mHitBox].element != elem)
+ {
+  mHitBoxesDirty = boxed;
+  return;
+ }
+ 
+ if (boxed == false)
+ {
+  mHitBoxesDirty = true;
+  return;
+ }
+ 
+ const HitBox& built = mHitBoxes[elem->mHitBox];
+ HitBox box;
+ _boxHit(elem, built.listened, box);
+ mHitBoxesDirty = box.left != built.left || box.top != built.top || box.right != built.right || box.bottom != built.bottom || box.target != built.target;
+ 
+}
+
+Element* PuzzleTree::_hitTest(float x, float y, size_t begin, size_t end)
+{
+ 
+ Element* hit = 0;
+ size_t depth = 0;
+ size_t i = begin;
+ while (i < end)
+ {
+  const HitBox& box = mHitBoxes[i];
+  mFrameStats.hit_test_elements_visited++;
+  
+  if (box.interactive == false || x < box.reach_left || x >= box.reach_right || y < box.reach_top || y >= box.reach_bottom)
+  {
+   i = box.end;
+   continue;
+  }
+  
+  if (box.target && x >= box.left && x < box.right && y >= box.top && y < box.bottom && (hit == 0 || box.depth >= depth))
+  {
+   hit = box.element;
+   depth = box.depth;
+  }
+  i++;
+ }
+ return hit;
+ 
+}
+
+bool PuzzleTree::_activate(Element* elem, const OIS::MouseState* state)
+{
+ 
+ if (elem->getType() == ElementType_TextBox)
+ {
+  beginTextMode(elem);
+ }
+ else if (elem->getType() == ElementType_OSKSubmit)
+ {
+  endTextMode();
+  return false;
+ }
+ else if (elem->getType() == ElementType_OSKCancel)
+ {
+  _cancelTextMode();
+  return false;
+ }
+ else
+ {
+  _fire(ElementEvent_Activated, elem, state);
+ }
+ return true;
+ 
+}
+
+void PuzzleTree::_buildNavigation()
+{
+ 
+ MONKEY_TRACE("navigation", "input");
+ 
+ mNavNodes.clear();
+ mNavScope = getScope();
+ mNavDirty = false;
+ 
+ size_t begin = 0, end = mHitBoxes.size();
+ if (mNavScope)
+ {
+  if (mNavScope->mHitBox < mHitBoxes.size() && mHitBoxes[mNavScope->mHitBox].element == mNavScope)
+  {
+   begin = mNavScope->mHitBox;
+   end = mHitBoxes[begin].end;
+  }
+  else
+   begin = end;
+ }
+ 
+ for (size_t i=begin;i < end;i++)
+ {
+  const HitBox& box = mHitBoxes[i];
+  if (box.target == false || box.element->mListening == false)
+   continue;
+  NavNode node;
+  node.element = box.element;
+  node.x = (box.left + box.right) * 0.5f;
+  node.y = (box.top + box.bottom) * 0.5f;
+  mNavNodes.push_back(node);
+ }
+ 
+ size_t count = mNavNodes.size();
+ if (count == 0)
+  return;
+ 
+ // Sorted along each axis, so the search for a neighbour stops once the distance along it can't win.
+ std::vector<size_t> byX(count), byY(count), reading(count);
+ for (size_t i=0;i < count;i++)
+  byX[i] = byY[i] = reading[i] = i;
+ std::sort(byX.begin(), byX.end(), [this](size_t a, size_t b) { return mNavNodes[a].x < mNavNodes[b].x; });
+ std::sort(byY.begin(), byY.end(), [this](size_t a, size_t b) { return mNavNodes[a].y < mNavNodes[b].y; });
+ std::sort(reading.begin(), reading.end(), [this](size_t a, size_t b) { return mNavNodes[a].y < mNavNodes[b].y || (mNavNodes[a].y == mNavNodes[b].y && mNavNodes[a].x < mNavNodes[b].x); });
+ 
+ std::vector<size_t> atX(count), atY(count);
+ for (size_t i=0;i < count;i++)
+ {
+  atX[byX[i]] = i;
+  atY[byY[i]] = i;
+ }
+ 
+ for (size_t n=0;n < count;n++)
+ {
+  NavNode& node = mNavNodes[n];
+  
+  for (int dir=Navigate_Up;dir <= Navigate_Right;dir++)
+  {
+   bool vertical = dir == Navigate_Up || dir == Navigate_Down;
+   long step = (dir == Navigate_Up || dir == Navigate_Left) ? -1 : 1;
+   const std::vector<size_t>& order = vertical ? byY : byX;
+   
+   // The distance along the direction plus twice the distance across it.
+   size_t best = std::string::npos;
+   float bestScore = 0;
+   for (long i=long(vertical ? atY[n] : atX[n]) + step;i >= 0 && i < long(count);i += step)
    {
-    S::slice_to_first_of(working, 'p');
-    top = Ogre::StringConverter::parseInt(working);
-    top_unit = Unit_Pixel;
-    top_set = true;
+    const NavNode& other = mNavNodes[order[i]];
+    float along = (vertical ? other.y - node.y : other.x - node.x) * step;
+    if (best != std::string::npos && along >= bestScore)
+     break;
+    if (along <= 0)
+     continue;
+    float score = along + 2 * std::abs(vertical ? other.x - node.x : other.y - node.y);
+    if (best == std::string::npos || score < bestScore)
+    {
+     best = order[i];
+     bestScore = score;
+    }
    }
+   node.neighbours[dir] = best;
+  }
+  
+  node.element->mNavNode = n;
+ }
+ 
+ mNavFirst = reading[0];
+ for (size_t i=0;i < count;i++)
+ {
+  mNavNodes[reading[i]].neighbours[Navigate_Next] = reading[(i + 1) % count];
+  mNavNodes[reading[i]].neighbours[Navigate_Previous] = reading[(i + count - 1) % count];
+ }
+ 
+}
+
+Element* PuzzleTree::navigate(NavigationDirection direction)
+{
+ 
+ MONKEY_PROFILE(this, input);
+ MONKEY_TRACE("navigate", "input");
+ 
+ if (mHitBoxesDirty)
+  _buildHitBoxes();
+ if (mNavDirty || mNavScope != getScope())
+  _buildNavigation();
+ 
+ if (mNavNodes.empty())
+  return 0;
+ 
+ // Without a focus, the first element in reading order is focused.
+ Element* focus = mLastEventElement;
+ size_t next = mNavFirst;
+ if (focus && focus->mNavNode < mNavNodes.size() && mNavNodes[focus->mNavNode].element == focus)
+ {
+  next = mNavNodes[focus->mNavNode].neighbours[direction];
+  if (next == std::string::npos)
+   return focus;
+ }
+ 
+ focus = mNavNodes[next].element;
+ if (focus != mLastEventElement)
+ {
+  if (mLastEventElement)
+   mLastEventElement->setState(ElementState_Normal);
+  focus->setState(ElementState_Hover);
+  mLastEventElement = focus;
+  _fire(ElementEvent_Focused, focus, 0);
+ }
+ return mLastEventElement;
+ 
+}
+
+void PuzzleTree::activateFocus()
+{
+ MONKEY_PROFILE(this, input);
+ MONKEY_TRACE("activate", "input");
+ if (mLastEventElement)
+  _activate(mLastEventElement, 0);
+}
+
+void PuzzleTree::_fire(ElementEventType type, Element* elem, const OIS::MouseState* state)
+{
+ 
+ if (mBufferEvents)
+ {
+  ElementEvent evt = { type, elem, state ? int(state->X.abs) : 0, state ? int(state->Y.abs) : 0, state ? state->buttons : 0 };
+  mEvents.push_back(evt);
+  return;
+ }
+ 
+ _deliver(type, elem, state ? *state : OIS::MouseState());
+ 
+}
+
+void PuzzleTree::_deliver(ElementEventType type, Element* elem, const OIS::MouseState& state)
+{
+ 
+#ifdef MONKEY_TRACING
+ static const char* names[4] = { "onElementActivated", "onElementFocused", "onElementBlur", "onTextboxChanged" };
+ MONKEY_TRACE(names[type], "callback", &elem->getID(), elem->getType());
+#endif
+ mFrameStats.callbacks_fired++;
+ 
+ // The listener may destroy the element, which marks the delivery.
+ Delivery delivery = { elem, false, mDelivering };
+ mDelivering = &delivery;
+ Callback* callbacks[2] = { elem->mListener, mCallback };
+ for (size_t i=0;i < 2 && delivery.destroyed == false;i++)
+ {
+  Callback* callback = callbacks[i];
+  if (callback == 0)
+   continue;
+  switch(type)
+  {
+   case ElementEvent_Activated:      callback->onElementActivated(elem, state); break;
+   case ElementEvent_Focused:        callback->onElementFocused(elem, state); break;
+   case ElementEvent_Blur:           callback->onElementBlur(elem, state); break;
+   case ElementEvent_TextboxChanged: callback->onTextboxChanged(elem); break;
+  }
+ }
+ mDelivering = delivery.outer;
+ 
+}
+
+const std::vector<ElementEvent>& PuzzleTree::pollEvents()
+{
+ mPolledEvents.clear();
+ mPolledEvents.swap(mEvents);
+ return mPolledEvents;
+}
+
+void PuzzleTree::dispatchEvents()
+{
+ 
+ pollEvents();
+ 
+ OIS::MouseState state;
+ state.width = int(mBackend->getWidth());
+ state.height = int(mBackend->getHeight());
+ 
+ // Indexed, as destroying an element clears it from the polled events.
+ for (size_t i=0;i < mPolledEvents.size();i++)
+ {
+  const ElementEvent& evt = mPolledEvents[i];
+  if (evt.element == 0)
+   continue;
+  state.X.abs = evt.x;
+  state.Y.abs = evt.y;
+  state.buttons = evt.buttons;
+  _deliver(evt.type, evt.element, state);
+ }
+ 
+}
+
+void PuzzleTree::update()
+{
+ _checkWatchedCSS();
+ mFrameStats.commands_executed += mCommands->_drain(this);
+ _commitBindings();
+ _instantiate();
+ mLastFrameStats = mFrameStats;
+ mFrameStats.reset();
+}
+
+void PuzzleTree::mouseMoved( const OIS::MouseEvent &arg )
+{
+ 
+ if (mInputRecorder)
+  mInputRecorder->_recordMouse(InputEvent_MouseMoved, arg.state, -1);
+ 
+ if (arg.state.Z.rel != 0 && mCurrentTextElement == 0)
+ {
+  float x = arg.state.X.abs, y = arg.state.Y.abs;
+  for (std::vector<Element*>::reverse_iterator it = mListElements.rbegin(); it != mListElements.rend(); it++)
+  {
+   Element* list = (*it);
+   if (list->isVisible() == false || _inScope(list) == false)
+    continue;
+   if (x < list->getScreenLeft() || x >= list->getScreenLeft() + list->getScreenWidth() ||
+       y < list->getScreenTop() || y >= list->getScreenTop() + list->getScreenHeight())
+    continue;
+   // One wheel notch (120) scrolls one row.
+   list->scrollList(-float(arg.state.Z.rel) / 120.0f * list->getListRowHeight());
+   break;
+  }
+ }
+ 
+ ElementState state = ElementState_Hover;
+ if (arg.state.buttonDown(OIS::MB_Left))
+  state = ElementState_Active;
+ _checkMouse(arg, OIS::MB_Button7, 0, state);
+}
+
+void PuzzleTree::mousePressed( const OIS::MouseEvent &arg, OIS::MouseButtonID id )
+{
+ if (mInputRecorder)
+  mInputRecorder->_recordMouse(InputEvent_MousePressed, arg.state, id);
+ _checkMouse(arg, id, 1, ElementState_Active);
+}
+
+void PuzzleTree::mouseReleased( const OIS::MouseEvent &arg, OIS::MouseButtonID id )
+{
+ if (mInputRecorder)
+  mInputRecorder->_recordMouse(InputEvent_MouseReleased, arg.state, id);
+ _checkMouse(arg, id, 2, ElementState_Hover);
+}
+
+void PuzzleTree::onKeyPress(char character)
+{
+ if (mInputRecorder)
+  mInputRecorder->_recordKey(InputEvent_KeyPress, character);
+ MONKEY_PROFILE(this, input);
+ MONKEY_TRACE("key", "input");
+ if (mCurrentTextElement == 0)
+  return;
+ mCurrentTextString.push_back(character);
+ if (Element* input = _getSingleton(ElementType_OSKInput))
+  input->setText(mCurrentTextString + "|");
+}
+
+void PuzzleTree::onKeyBackspace()
+{
+ if (mInputRecorder)
+  mInputRecorder->_recordKey(InputEvent_KeyBackspace, 0);
+ MONKEY_PROFILE(this, input);
+ MONKEY_TRACE("key", "input");
+ if (mCurrentTextElement == 0)
+  return;
+ if (mCurrentTextString.length())
+  mCurrentTextString.pop_back();
+ if (Element* input = _getSingleton(ElementType_OSKInput))
+  input->setText(mCurrentTextString + "|");
+}
+
+void PuzzleTree::beginTextMode(Element* element)
+{
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ endTextMode();
+ if (_inScope(element) == false)
+  return;
+ mCurrentTextElement = element;
+ mCurrentTextString = mCurrentTextElement->getText();
+ if (_requireOSK() == false)
+  return;
+ if (Element* title = _getSingleton(ElementType_OSKTitle))
+  title->setText(mCurrentTextElement->getTitle());
+ if (Element* input = _getSingleton(ElementType_OSKInput))
+  input->setText(mCurrentTextElement->getText() + "|");
+ Element* osk = _getSingleton(ElementType_OSKContainer);
+ osk->show();
+ pushScope(osk);
+}
+
+void PuzzleTree::onKeySubmit()
+{
+ if (mInputRecorder)
+  mInputRecorder->_recordKey(InputEvent_KeySubmit, 0);
+ endTextMode();
+}
+
+void PuzzleTree::onKeyCancel()
+{
+ if (mInputRecorder)
+  mInputRecorder->_recordKey(InputEvent_KeyCancel, 0);
+ _cancelTextMode();
+}
+
+void PuzzleTree::_cancelTextMode()
+{
+ if (mCurrentTextElement)
+ {
+  if (Element* osk = _getSingleton(ElementType_OSKContainer))
+  {
+   osk->hide();
+   _removeScope(osk);
+  }
+  mCurrentTextElement = 0;
+ }
+}
+
+void PuzzleTree::endTextMode()
+{
+ 
+ if (mCurrentTextElement)
+ {
+  mCurrentTextElement->setText(mCurrentTextString);
+  if (Element* osk = _getSingleton(ElementType_OSKContainer))
+  {
+   osk->hide();
+   _removeScope(osk);
+  }
+  Element* elem = mCurrentTextElement;
+  mCurrentTextElement = 0;
+  _fire(ElementEvent_TextboxChanged, elem, 0);
+ }
+ 
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+thread_local FrameStats* PuzzleTree::sWorkerFrameStats = 0;
+
+// Cascades element subtrees on a fixed set of threads. Every thread keeps a deque of elements whose
+// parents are cascaded; it works from the back of its own and steals from the front of the others.
+class CascadePool
+{
+ public:
+  
+  // The thread calling run() is one of the threads.
+  CascadePool(size_t threads)
+  : mGeneration(0),
+    mFinished(0),
+    mQuit(false),
+    mPending(0)
+  {
+   mQueues.resize(threads);
+   mStats.resize(threads);
+   for (size_t i=1;i < threads;i++)
+    mThreads.push_back(std::thread(&CascadePool::_thread, this, i));
+  }
+  
+ ~CascadePool()
+  {
+   {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mQuit = true;
+   }
+   mWake.notify_all();
+   for (size_t i=0;i < mThreads.size();i++)
+    mThreads[i].join();
+  }
+  
+  size_t getThreadCount() const { return mQueues.size(); }
+  
+  // Returns once every root and its descendants are cascaded; stats gets what each thread counted.
+  void run(const std::vector<Element*>& roots, FrameStats& stats)
+  {
+   
+   for (size_t i=0;i < mStats.size();i++)
+   {
+    mStats[i].reset();
+    mStats[i].parse.depth = mStats[i].cascade.depth = mStats[i].layout.depth = mStats[i].input.depth = 0;
+   }
+   
+   for (size_t i=0;i < roots.size();i++)
+    mQueues[i % mQueues.size()].tasks.push_back(roots[i]);
+   mPending.store(roots.size());
+   
+   {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mFinished = 0;
+    mGeneration++;
+   }
+   mWake.notify_all();
+   
+   _work(0);
+   
+   {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mFinished < mThreads.size())
+     mDone.wait(lock);
+   }
+   
+   for (size_t i=0;i < mStats.size();i++)
+    stats.add(mStats[i]);
+  }
+  
+ protected:
+  
+  struct Queue
+  {
+   std::mutex mutex;
+   std::deque<Element*> tasks;
+  };
+  
+  void _thread(size_t index)
+  {
+   size_t generation = 0;
+   for (;;)
+   {
+    {
+     std::unique_lock<std::mutex> lock(mMutex);
+     while (mQuit == false && mGeneration == generation)
+      mWake.wait(lock);
+     if (mQuit)
+      return;
+     generation = mGeneration;
+    }
+    
+    _work(index);
+    
+    {
+     std::lock_guard<std::mutex> lock(mMutex);
+     mFinished++;
+    }
+    mDone.notify_one();
+   }
+  }
+  
+  void _work(size_t index)
+  {
+   
+   PuzzleTree::sWorkerFrameStats = &mStats[index];
+   
+   std::vector<Element*> children;
+   Element* elem = 0;
+   while (mPending.load() != 0)
+   {
+    if (_take(index, elem) == false)
+    {
+     std::this_thread::yield();
+     continue;
+    }
+    
+    children.clear();
+    elem->_cascadePending(children);
+    
+    // Count the children before this element is done, so the pending count never reaches zero early.
+    if (children.size())
+    {
+     mPending.fetch_add(children.size());
+     std::lock_guard<std::mutex> lock(mQueues[index].mutex);
+     mQueues[index].tasks.insert(mQueues[index].tasks.end(), children.begin(), children.end());
+    }
+    mPending.fetch_sub(1);
+   }
+   
+   PuzzleTree::sWorkerFrameStats = 0;
+  }
+  
+  bool _take(size_t index, Element*& elem)
+  {
+   {
+    Queue& own = mQueues[index];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (own.tasks.size())
+    {
+     elem = own.tasks.back();
+     own.tasks.pop_back();
+     return true;
+    }
+   }
+   
+   for (size_t i=1;i < mQueues.size();i++)
+   {
+    Queue& other = mQueues[(index + i) % mQueues.size()];
+    std::lock_guard<std::mutex> lock(other.mutex);
+    if (other.tasks.size())
+    {
+     elem = other.tasks.front();
+     other.tasks.pop_front();
+     return true;
+    }
+   }
+   
+   return false;
+  }
+  
+  std::vector<std::thread>                   mThreads;
+  std::deque<Queue>                          mQueues;
+  std::vector<FrameStats>                    mStats;
+  std::mutex                                 mMutex;
+  std::condition_variable                    mWake, mDone;
+  size_t                                     mGeneration, mFinished;
+  bool                                       mQuit;
+  std::atomic<size_t>                        mPending;
+};
+
+void PuzzleTree::setCascadeThreads(size_t threads)
+{
+ mCascadeThreads = std::max<size_t>(threads, 1);
+ if (mCascadePool && mCascadePool->getThreadCount() != mCascadeThreads)
+ {
+  delete mCascadePool;
+  mCascadePool = 0;
+ }
+}
+
+void PuzzleTree::_cascadeDeferred()
+{
+ 
+ std::vector<Element*> roots;
+ roots.swap(mDeferred);
+ 
+ if (mCascadePool == 0)
+  mCascadePool = new CascadePool(mCascadeThreads);
+ 
+ mCascadePool->run(roots, mFrameStats);
+ 
+ // Primitives are made here, on the calling thread.
+ for (size_t i=0;i < roots.size();i++)
+  roots[i]->reapplyLook();
+ 
+}
+
+// After CascadePool, which it deletes.
+PuzzleTree::~PuzzleTree()
+{
+ // TODO: Cleanup
+#ifdef __linux__
+ if (mInotify != -1)
+  close(mInotify);
+#endif
+ for (std::map<Ogre::String, MamlTemplate*>::iterator it = mTemplates.begin(); it != mTemplates.end(); it++)
+  delete (*it).second;
+ delete mOSKTemplate;
+ for (std::map<Ogre::String, MamlDocument*>::iterator it = mDocuments.begin(); it != mDocuments.end(); it++)
+ {
+  for (size_t i=0;i < (*it).second->elements.size();i++)
+   if ((*it).second->elements[i])
+    (*it).second->elements[i]->mDocument = 0;
+  delete (*it).second;
+ }
+ for (size_t i=0;i < mInstantiations.size();i++)
+  delete mInstantiations[i];
+ delete mCascadePool;
+ delete mCommands;
+ delete mGorillaBackend;
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+DetachedTree::DetachedTree()
+: mReady(false),
+  mAttached(0),
+  mCommitted(false)
+{
+ mStats.reset();
+ mStats.parse.depth = mStats.cascade.depth = mStats.layout.depth = mStats.input.depth = 0;
+}
+
+DetachedTree::~DetachedTree()
+{
+ wait();
+ for (size_t i=mAttached;i < mRoots.size();i++)
+  delete mRoots[i];
+ if (mCommitted == false)
+ {
+  for (size_t i=0;i < mRules.size();i++)
+   delete mRules[i].second;
+  for (size_t i=0;i < mTemplates.size();i++)
+   delete mTemplates[i].second;
+ }
+}
+
+void DetachedTree::wait()
+{
+ if (mThread.joinable())
+  mThread.join();
+}
+
+DetachedTree* PuzzleTree::mamlAsync(const Ogre::String& maml_path)
+{
+ DetachedTree* detached = new DetachedTree();
+ detached->mThread = std::thread([this, detached, maml_path]()
+ {
+  MONKEY_TRACE("maml", "parse", &maml_path);
+  sWorkerFrameStats = &detached->mStats;
+  {
+   MONKEY_PROFILE(this, parse);
+   std::vector<MamlNode> nodes;
+   SecretMonkey::parseMaml(SecretMonkey::openResource(maml_path), mElementTypes, nodes);
+   SecretMonkey::extractTemplates(nodes, detached->mTemplates);
+   _buildMaml(nodes, true, detached->mRoots);
+  }
+  sWorkerFrameStats = 0;
+  detached->mReady.store(true, std::memory_order_release);
+ });
+ return detached;
+}
+
+DetachedTree* PuzzleTree::loadCSSAsync(const Ogre::String& css_file_name_path)
+{
+ DetachedTree* detached = new DetachedTree();
+ detached->mCSS = css_file_name_path;
+ detached->mThread = std::thread([this, detached, css_file_name_path]()
+ {
+  MONKEY_TRACE("loadCSS", "parse", &css_file_name_path);
+  sWorkerFrameStats = &detached->mStats;
+  {
+   MONKEY_PROFILE(this, parse);
+   SecretMonkey::parseCSS(SecretMonkey::openResource(css_file_name_path), detached->mAtlas, detached->mRules);
+  }
+  sWorkerFrameStats = 0;
+  detached->mReady.store(true, std::memory_order_release);
+ });
+ return detached;
+}
+
+bool PuzzleTree::attach(DetachedTree* detached, double budget_ms)
+{
+ 
+ if (detached->isReady() == false)
+  return false;
+ 
+ MONKEY_TRACE("attach", "parse");
+ 
+ typedef std::chrono::high_resolution_clock Clock;
+ Clock::time_point start = Clock::now();
+ 
+ if (detached->mCommitted == false)
+ {
+  detached->wait();
+  mFrameStats.add(detached->mStats);
+  if (detached->mRules.size())
+   _commitCSS(detached->mAtlas, detached->mRules, detached->mCSS);
+  _commitTemplates(detached->mTemplates);
+  detached->mCommitted = true;
+ }
+ 
+ while (detached->mAttached < detached->mRoots.size())
+ {
+  Element* root = detached->mRoots[detached->mAttached++];
+  root->_attach();
+  root->reapplyLook();
+  
+  if (budget_ms > 0 && std::chrono::duration<double, std::milli>(Clock::now() - start).count() >= budget_ms)
+   break;
+ }
+ 
+ if (detached->mAttached < detached->mRoots.size())
+  return false;
+ 
+ delete detached;
+ return true;
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void Observable::_changed()
+{
+ if (mTree == 0 || mDirty)
+  return;
+ mDirty = true;
+ mTree->mChangedObservables.push_back(this);
+}
+
+void PuzzleTree::addObservable(const Ogre::String& name, Observable* observable)
+{
+ removeObservable(name);
+ observable->mTree = this;
+ observable->mName = name;
+ observable->mDirty = false;
+ mBindings[name].observable = observable;
+ observable->_changed();
+}
+
+void PuzzleTree::removeObservable(const Ogre::String& name)
+{
+ std::map<Ogre::String, Binding>::iterator it = mBindings.find(name);
+ if (it == mBindings.end() || (*it).second.observable == 0)
+  return;
+ Observable* observable = (*it).second.observable;
+ mChangedObservables.erase(std::remove(mChangedObservables.begin(), mChangedObservables.end(), observable), mChangedObservables.end());
+ observable->mTree = 0;
+ observable->mDirty = false;
+ (*it).second.observable = 0;
+}
+
+void PuzzleTree::_bind(Element* elem)
+{
+ 
+ if (elem->mBinding.length())
+ {
+  Binding& binding = mBindings[elem->mBinding];
+  binding.text.push_back(elem);
+  if (binding.observable)
+   elem->mText = binding.observable->format();
+ }
+ 
+ if (elem->mClassBinding.length())
+ {
+  Binding& binding = mBindings[elem->mClassBinding];
+  binding.classes.push_back(elem);
+  if (binding.observable)
+   elem->_setBoundClass(binding.observable->format(), false);
+ }
+ 
+}
+
+void PuzzleTree::_unbind(Element* elem)
+{
+ 
+ const Ogre::String* names[2] = { &elem->mBinding, &elem->mClassBinding };
+ for (size_t i=0;i < 2;i++)
+ {
+  std::map<Ogre::String, Binding>::iterator it = mBindings.find(*names[i]);
+  if (it == mBindings.end())
+   continue;
+  std::vector<Element*>& elements = i == 0 ? (*it).second.text : (*it).second.classes;
+  elements.erase(std::remove(elements.begin(), elements.end(), elem), elements.end());
+ }
+ 
+}
+
+void PuzzleTree::_commitBindings()
+{
+ 
+ if (mChangedObservables.empty())
+  return;
+ 
+ MONKEY_TRACE("bindings", "update");
+ 
+ std::vector<Observable*> changed;
+ changed.swap(mChangedObservables);
+ 
+ for (size_t i=0;i < changed.size();i++)
+ {
+  Observable* observable = changed[i];
+  observable->mDirty = false;
+  Binding& binding = mBindings[observable->mName];
+  
+  // Formatted once, for every element bound to it.
+  Ogre::String value = observable->format();
+  
+  for (size_t j=0;j < binding.text.size();j++)
+  {
+   if (binding.text[j]->getText() == value)
+    continue;
+   binding.text[j]->setText(value);
+   mFrameStats.bindings_applied++;
+  }
+  
+  for (size_t j=0;j < binding.classes.size();j++)
+  {
+   binding.classes[j]->_setBoundClass(value, true);
+   mFrameStats.bindings_applied++;
+  }
+ }
+ 
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+CommandQueue::CommandQueue(size_t capacity, size_t text_bytes)
+: mEnqueue(0),
+  mDequeue(0),
+  mArenaSize(text_bytes),
+  mArena(0),
+  mRetired(0),
+  mRetiring(false),
+  mDropped(0)
+{
+ 
+ size_t size = 2;
+ while (size < capacity)
+  size <<= 1;
+ mMask = size - 1;
+ 
+ // A cell is free for the push with ticket i when its sequence is i, and full when it is i + 1.
+ mCells = new Cell[size];
+ for (size_t i=0;i < size;i++)
+  mCells[i].sequence.store(i, std::memory_order_relaxed);
+ 
+ for (size_t i=0;i < 2;i++)
+ {
+  mArenas[i].text = new char[text_bytes];
+  mArenas[i].used.store(0, std::memory_order_relaxed);
+  mArenas[i].writers.store(0, std::memory_order_relaxed);
+ }
+ 
+}
+
+CommandQueue::~CommandQueue()
+{
+ delete [] mCells;
+ delete [] mArenas[0].text;
+ delete [] mArenas[1].text;
+}
+
+bool CommandQueue::_push(Command& command, const Ogre::String* text)
+{
+ 
+ Arena* arena = 0;
+ command.arena = command.offset = command.length = 0;
+ 
+ if (text)
+ {
+  // Become a writer of the current arena; the update waits for its writers before draining.
+  for (;;)
+  {
+   size_t index = mArena.load();
+   arena = &mArenas[index];
+   arena->writers.fetch_add(1);
+   if (mArena.load() == index)
+   {
+    command.arena = index;
+    break;
+   }
+   arena->writers.fetch_sub(1);
+  }
+  
+  size_t offset = arena->used.fetch_add(text->length(), std::memory_order_relaxed);
+  if (offset + text->length() > mArenaSize)
+  {
+   arena->writers.fetch_sub(1);
+   mDropped.fetch_add(1, std::memory_order_relaxed);
+   return false;
+  }
+  memcpy(arena->text + offset, text->data(), text->length());
+  command.offset = offset;
+  command.length = text->length();
+ }
+ 
+ bool pushed = false;
+ size_t ticket = mEnqueue.load(std::memory_order_relaxed);
+ for (;;)
+ {
+  Cell& cell = mCells[ticket & mMask];
+  size_t sequence = cell.sequence.load(std::memory_order_acquire);
+  ptrdiff_t difference = ptrdiff_t(sequence) - ptrdiff_t(ticket);
+  if (difference == 0)
+  {
+   if (mEnqueue.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed))
+   {
+    cell.command = command;
+    cell.sequence.store(ticket + 1, std::memory_order_release);
+    pushed = true;
+    break;
+   }
+  }
+  else if (difference < 0)
+   break;  // Full.
+  else
+   ticket = mEnqueue.load(std::memory_order_relaxed);
+ }
+ 
+ if (arena)
+  arena->writers.fetch_sub(1);
+ 
+ if (pushed == false)
+  mDropped.fetch_add(1, std::memory_order_relaxed);
+ 
+ return pushed;
+}
+
+size_t CommandQueue::_drain(PuzzleTree* tree)
+{
+ 
+ MONKEY_TRACE("commands", "update");
+ 
+ // Swap the arenas, then wait for the writers of the old one; every command with text in it then has a
+ // ticket below mEnqueue. A producer stalled between taking its ticket and publishing it holds up the
+ // drain, so the old arena is kept until the drain has passed those tickets, and the arenas only swap
+ // again after that.
+ if (mRetiring == false)
+ {
+  size_t old = mArena.load();
+  mArena.store(old ^ 1);
+  while (mArenas[old].writers.load() != 0)
+   std::this_thread::yield();
+  mRetired = mEnqueue.load();
+  mRetiring = true;
+ }
+ 
+ // Commands pushed while draining wait for the next update.
+ size_t run = 0;
+ for (;run <= mMask;run++)
+ {
+  Cell& cell = mCells[mDequeue & mMask];
+  if (cell.sequence.load(std::memory_order_acquire) != mDequeue + 1)
+   break;
+  Command command = cell.command;
+  cell.sequence.store(mDequeue + mMask + 1, std::memory_order_release);
+  mDequeue++;
+  
+  Ogre::String text(mArenas[command.arena].text + command.offset, command.length);
+  
+  switch(command.type)
+  {
+   case Command_SetText:     command.element->setText(text); break;
+   case Command_SetState:    command.element->setState(ElementState(command.value)); break;
+   case Command_Show:        command.element->show(); break;
+   case Command_Hide:        command.element->hide(); break;
+   case Command_AddClass:    command.element->addClass(text); break;
+   case Command_RemoveClass: command.element->removeClass(text); break;
+   case Command_Destroy:     tree->destroyElement(command.element); break;
+   case Command_Create:
+   {
+    Element* elem = command.element ? command.element->createChild(text, command.value) : tree->createElement(text, command.value);
+    if (command.created)
+     *command.created = elem;
+   }
+   break;
+  }
+ }
+ 
+ // Nothing refers to the old arena's text now; it becomes current on the next swap.
+ if (mRetiring && ptrdiff_t(mDequeue - mRetired) >= 0)
+ {
+  mArenas[mArena.load() ^ 1].used.store(0);
+  mRetiring = false;
+ }
+ 
+ return run;
+}
+
+bool CommandQueue::setText(Element* elem, const Ogre::String& text)
+{
+ Command command = { Command_SetText, elem, 0, 0, 0, 0, 0 };
+ return _push(command, &text);
+}
+
+bool CommandQueue::setState(Element* elem, ElementState state)
+{
+ Command command = { Command_SetState, elem, int(state), 0, 0, 0, 0 };
+ return _push(command);
+}
+
+bool CommandQueue::show(Element* elem)
+{
+ Command command = { Command_Show, elem, 0, 0, 0, 0, 0 };
+ return _push(command);
+}
+
+bool CommandQueue::hide(Element* elem)
+{
+ Command command = { Command_Hide, elem, 0, 0, 0, 0, 0 };
+ return _push(command);
+}
+
+bool CommandQueue::addClass(Element* elem, const Ogre::String& name)
+{
+ Command command = { Command_AddClass, elem, 0, 0, 0, 0, 0 };
+ return _push(command, &name);
+}
+
+bool CommandQueue::removeClass(Element* elem, const Ogre::String& name)
+{
+ Command command = { Command_RemoveClass, elem, 0, 0, 0, 0, 0 };
+ return _push(command, &name);
+}
+
+bool CommandQueue::create(Element* parent, const Ogre::String& id_and_or_classes, int type, Element** created)
+{
+ Command command = { Command_Create, parent, type, created, 0, 0, 0 };
+ return _push(command, &id_and_or_classes);
+}
+
+bool CommandQueue::destroy(Element* elem)
+{
+ Command command = { Command_Destroy, elem, 0, 0, 0, 0, 0 };
+ return _push(command);
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+namespace SecretMonkey
+{
+
+struct TraceEvent
+{
+ const char* name;
+ const char* category;
+ long long start, duration;
+ int type;
+ char id[32];
+};
+
+// Written only by its own thread; the head is published after each event so a reader sees whole events.
+struct TraceBuffer
+{
+ static const size_t Capacity = 16384;
+ TraceEvent events[Capacity];
+ std::atomic<size_t> head;
+ size_t tail;
+ size_t thread;
+};
+
+std::mutex& traceRegistryMutex()
+{
+ static std::mutex mutex;
+ return mutex;
+}
+
+std::vector<TraceBuffer*>& traceRegistry()
+{
+ static std::vector<TraceBuffer*> registry;
+ return registry;
+}
+
+// Registered once per thread, on its first event; the buffers live for the rest of the process.
+TraceBuffer* traceBuffer()
+{
+ static thread_local TraceBuffer* buffer = 0;
+ if (buffer == 0)
+ {
+  buffer = new TraceBuffer();
+  buffer->head.store(0, std::memory_order_relaxed);
+  buffer->tail = 0;
+  std::lock_guard<std::mutex> lock(traceRegistryMutex());
+  buffer->thread = traceRegistry().size() + 1;
+  traceRegistry().push_back(buffer);
+ }
+ return buffer;
+}
+
+const char* traceTypeName(int type)
+{
+ switch(type)
+ {
+  case ElementType_Block:        return "block";
+  case ElementType_Button:       return "button";
+  case ElementType_TextBox:      return "textbox";
+  case ElementType_List:         return "list";
+  case ElementType_OSKContainer: return "osk";
+  case ElementType_OSKTitle:     return "osk-title";
+  case ElementType_OSKInput:     return "osk-input";
+  case ElementType_OSKSubmit:    return "osk-submit";
+  case ElementType_OSKCancel:    return "osk-cancel";
+ }
+ return 0;
+}
+
+void writeJSONString(std::ostream& out, const char* str)
+{
+ out << '"';
+ for (;*str;str++)
+ {
+  if (*str == '"' || *str == '\\')
+   out << '\\' << *str;
+  else if (Ogre::uchar(*str) >= 32)
+   out << *str;
+ }
+ out << '"';
+}
+
+} // namespace SecretMonkey
+
+std::atomic<bool> Trace::sEnabled(false);
+
+long long Trace::_now()
+{
+ return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::_record(const char* name, const char* category, long long start, long long end, const Ogre::String* id, int type)
+{
+ SecretMonkey::TraceBuffer* buffer = SecretMonkey::traceBuffer();
+ size_t head = buffer->head.load(std::memory_order_relaxed);
+ SecretMonkey::TraceEvent& evt = buffer->events[head % SecretMonkey::TraceBuffer::Capacity];
+ evt.name = name;
+ evt.category = category;
+ evt.start = start;
+ evt.duration = end - start;
+ evt.type = type;
+ evt.id[0] = 0;
+ if (id)
+ {
+  size_t length = std::min(id->length(), sizeof(evt.id) - 1);
+  memcpy(evt.id, id->c_str(), length);
+  evt.id[length] = 0;
+ }
+ buffer->head.store(head + 1, std::memory_order_release);
+}
+
+void Trace::clear()
+{
+ std::lock_guard<std::mutex> lock(SecretMonkey::traceRegistryMutex());
+ std::vector<SecretMonkey::TraceBuffer*>& registry = SecretMonkey::traceRegistry();
+ for (size_t i=0;i < registry.size();i++)
+  registry[i]->tail = registry[i]->head.load(std::memory_order_acquire);
+}
+
+void Trace::write(const Ogre::String& path)
+{
+ 
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ std::ofstream out(path.c_str());
+ out << "{\"traceEvents\":[\n";
+ bool first = true;
+ 
+ std::lock_guard<std::mutex> lock(S::traceRegistryMutex());
+ std::vector<S::TraceBuffer*>& registry = S::traceRegistry();
+ for (size_t i=0;i < registry.size();i++)
+ {
+  S::TraceBuffer* buffer = registry[i];
+  size_t head = buffer->head.load(std::memory_order_acquire);
+  size_t begin = std::max(buffer->tail, head > S::TraceBuffer::Capacity ? head - S::TraceBuffer::Capacity : size_t(0));
+  for (size_t j=begin;j < head;j++)
+  {
+   const S::TraceEvent& evt = buffer->events[j % S::TraceBuffer::Capacity];
+   out << (first ? "" : ",\n") << "{\"name\":";
+   S::writeJSONString(out, evt.name);
+   out << ",\"cat\":";
+   S::writeJSONString(out, evt.category);
+   out << ",\"ph\":\"X\",\"ts\":" << evt.start << ",\"dur\":" << evt.duration << ",\"pid\":1,\"tid\":" << buffer->thread;
+   const char* typeName = S::traceTypeName(evt.type);
+   if (evt.id[0] || typeName)
+   {
+    out << ",\"args\":{\"id\":";
+    S::writeJSONString(out, evt.id);
+    if (typeName)
+    {
+     out << ",\"type\":";
+     S::writeJSONString(out, typeName);
+    }
+    out << "}";
+   }
+   out << "}";
+   first = false;
+  }
+ }
+ 
+ out << "\n]}\n";
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+MemoryUsage::MemoryUsage()
+: elements(0), looks(0), styles(0), strings(0), containers(0), listeners(0), primitives(0)
+{
+}
+
+size_t MemoryUsage::total() const
+{
+ return elements + looks + styles + strings + containers + listeners + primitives;
+}
+
+MemoryUsage& MemoryUsage::operator+=(const MemoryUsage& other)
+{
+ elements += other.elements;
+ looks += other.looks;
+ styles += other.styles;
+ strings += other.strings;
+ containers += other.containers;
+ listeners += other.listeners;
+ primitives += other.primitives;
+ return *this;
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void FrameStats::add(const FrameStats& other)
+{
+ elements_laid_out += other.elements_laid_out;
+ elements_culled += other.elements_culled;
+ reapply_looks += other.reapply_looks;
+ style_lookups += other.style_lookups;
+ style_merges += other.style_merges;
+ primitives_created += other.primitives_created;
+ primitives_destroyed += other.primitives_destroyed;
+ primitive_setter_calls += other.primitive_setter_calls;
+ hit_tests += other.hit_tests;
+ hit_test_elements_visited += other.hit_test_elements_visited;
+ callbacks_fired += other.callbacks_fired;
+ commands_executed += other.commands_executed;
+ bindings_applied += other.bindings_applied;
+ ProfileTimer* timers[4] = { &parse, &cascade, &layout, &input };
+ const ProfileTimer* others[4] = { &other.parse, &other.cascade, &other.layout, &other.input };
+ for (size_t i=0;i < 4;i++)
+ {
+  timers[i]->microseconds += others[i]->microseconds;
+  timers[i]->scopes += others[i]->scopes;
+ }
+}
+
+void FrameStats::reset()
+{
+ elements_laid_out = 0;
+ elements_culled = 0;
+ reapply_looks = 0;
+ style_lookups = 0;
+ style_merges = 0;
+ primitives_created = 0;
+ primitives_destroyed = 0;
+ primitive_setter_calls = 0;
+ hit_tests = 0;
+ hit_test_elements_visited = 0;
+ callbacks_fired = 0;
+ commands_executed = 0;
+ bindings_applied = 0;
+ // Depth is left alone; update() may be called from inside a timed scope.
+ ProfileTimer* timers[4] = { &parse, &cascade, &layout, &input };
+ for (size_t i=0;i < 4;i++)
+ {
+  timers[i]->microseconds = 0;
+  timers[i]->scopes = 0;
+ }
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+void ElementStyle::reset()
+{
+ width = 1.0f;
+ width_unit = Unit_Percent;
+ width_set = false;
+ height = 0.1f;
+ height_unit = Unit_Percent;
+ height_set = false;
+ left = 0;
+ left_unit = Unit_Pixel;
+ left_set = false;
+ top = 0;
+ top_unit = Unit_Pixel;
+ top_set = false;
+ alignment.horz = Gorilla::TextAlign_Left;
+ alignment.horz_set = false;
+ alignment.vert = Gorilla::VerticalAlign_Top;
+ alignment.vert_set = false;
+ background.colour = Ogre::ColourValue::White;
+ background.set = false;
+ background.sprite.clear();
+ background.sprite_data = 0;
+ background.type = Background::BT_Transparent;
+ colour = Ogre::ColourValue::White;
+ colour_set = false;
+ font = 9;
+ glyph_data = 0;
+ font_set = false;
+ border.width = 0;
+ border.width_set = false;
+ border.left = Ogre::ColourValue::White;
+ border.left_set = false;
+ border.right= Ogre::ColourValue::White;
+ border.right_set = false;
+ border.bottom = Ogre::ColourValue::White;
+ border.bottom_set = false;
+ border.top = Ogre::ColourValue::White;
+ border.top_set = false;
+ overflow_hidden = false;
+ overflow_set = false;
+ pointer_events = true;
+ pointer_events_set = false;
+}
+
+void ElementStyle::to_css(Ogre::String& css)
+{
+ namespace S = ::Monkey::SecretMonkey;
+ std::stringstream s;
+
+ s << "left: " << left << ";\n"; // TODO: Units
+ s << "top: " << top << ";\n"; // TODO: Units
+ s << "width: " << width << ";\n"; // TODO: Units
+ s << "height: " << height << ";\n"; // TODO: Units
+
+ s << "text-align: ";
+ if (alignment.horz == Gorilla::TextAlign_Right)
+  s << " right;\n";
+ else if (alignment.horz == Gorilla::TextAlign_Centre)
+  s << " center;\n";
+ 
+ s << "vertical-align: ";
+ if (alignment.vert == Gorilla::VerticalAlign_Top)
+  s << " top;\n";
+ else if (alignment.vert == Gorilla::VerticalAlign_Bottom)
+  s << " bottom;\n";
+ else if (alignment.vert == Gorilla::VerticalAlign_Middle)
+  s << " middle;\n";
+ 
+ 
+  s << "border-width: " << border.width << ";\n";
+  s << "border-top: " << S::toCSSRGBAColour(border.top)  << ";\n";
+  s << "border-right: " << S::toCSSRGBAColour(border.right)  << ";\n";
+  s << "border-bottom: " << S::toCSSRGBAColour(border.bottom)  << ";\n";
+  s << "border-top: " << S::toCSSRGBAColour(border.top)  << ";\n";
+ 
+ if (background.type == Background::BT_Transparent)
+  s << "background: none;\n";
+ else if (background.type == Background::BT_Sprite)
+  s << "background-image: " << background.sprite << ";\n";
+ else if (background.type == Background::BT_Colour)
+  s << "background-colour: " << S::toCSSRGBAColour(background.colour) << ";\n";
+ 
+ if (overflow_hidden)
+  s << "overflow: hidden;\n";
+ 
+ if (pointer_events == false)
+  s << "pointer-events: none;\n";
+ 
+ s << "colour: " << S::toCSSRGBAColour(colour) << ";\n";
+ s << "font: " << font << ";\n";
+
+ css.assign(s.str());
+}
+
+void ElementStyle::from_css(const Ogre::String& key, const Ogre::String& value)
+{
+ 
+ namespace S = ::Monkey::SecretMonkey;
+ Ogre::String working(value);
+ S::trim(working);
+
+ if (key == "width")
+ {
+  if (S::has(working, '%'))
+  {
+   S::slice_to_first_of(working, '%');
+   width = Ogre::StringConverter::parseReal(working) * 0.01f;
+   width_unit = Unit_Percent;
+   width_set = true;
+  }
+  else if (S::has(working, 'p'))
+  {
+   S::slice_to_first_of(working, 'p');
+   width = Ogre::StringConverter::parseInt(working);
+   width_unit = Unit_Pixel;
+   width_set = true;
+  }
+  else
+  {
+   width = Ogre::StringConverter::parseInt(working);
+   width_unit = Unit_Pixel;
+   width_set = true;
+  }
+ }
+ else if (key == "height")
+ {
+  if (S::has(working, '%'))
+  {
+   S::slice_to_first_of(working, '%');
+   height = Ogre::StringConverter::parseReal(working) * 0.01;
+   height_unit = Unit_Percent;
+   height_set = true;
+  }
+  else if (S::has(working, 'p'))
+  {
+   S::slice_to_first_of(working, 'p');
+   height = Ogre::StringConverter::parseInt(working);
+   height_unit = Unit_Pixel;
+   height_set = true;
+  }
+  else
+  {
+   height = Ogre::StringConverter::parseInt(working);
+   height_unit = Unit_Pixel;
+   height_set = true;
+  }
+ }
+ else if (key == "left")
+ {
+  if (S::isInteger(working) == false)
+  {
+   // see if it has a modifier; px or %, if not, see if it matches left, center, left
+   if (working == "right")
+   {
+    left = 0;
+    left_unit = Unit_AlignRight;
+    left_set = true;
+   }
+   else if (working == "left")
+   {
+    left = 0;
+    left_unit = Unit_Pixel;
+    left_set = true;
+   }
+   else if (working == "center" || working == "centre")
+   {
+    left = 0;
+    left_unit = Unit_AlignCenter;
+    left_set = true;
+   }
+   else if (S::has(working, '%'))
+   {
+    S::slice_to_first_of(working, '%');
+    left = Ogre::StringConverter::parseReal(working) * 0.01;;
+    left_unit = Unit_Percent;
+    left_set = true;
+   }
+   else if (S::has(working, 'p'))
+   {
+    S::slice_to_first_of(working, 'p');
+    left = Ogre::StringConverter::parseInt(working);
+    left_unit = Unit_Pixel;
+    left_set = true;
+   }
+  }
+  else
+  {
+   left = Ogre::StringConverter::parseInt(working);
+   left_unit = Unit_Pixel;
+   left_set = true;
+  }
+ }
+ else if (key == "top")
+ {
+  if (S::isInteger(working) == false)
+  {
+   // see if it has a modifier; px or %, if not, see if it matches top, center, top
+   if (working == "right" || working == "bottom")
+   {
+    top = 0;
+    top_unit = Unit_AlignRight;
+    top_set = true;
+   }
+   else if (working == "top")
+   {
+    top = 0;
+    top_unit = Unit_Pixel;
+    top_set = true;
+   }
+   else if (working == "center" || working == "centre" || working == "middle")
+   {
+    top = 0;
+    top_unit = Unit_AlignCenter;
+    top_set = true;
+   }
+   else if (S::has(working, '%'))
+   {
+    S::slice_to_first_of(working, '%');
+    top = Ogre::StringConverter::parseReal(working) * 0.01;
+    top_unit = Unit_Percent;
+    top_set = true;
+   }
+   else if (S::has(working, 'p'))
+   {
+    S::slice_to_first_of(working, 'p');
+    top = Ogre::StringConverter::parseInt(working);
+    top_unit = Unit_Pixel;
+    top_set = true;
+   }
+  }
+  else
+  {
+   top = Ogre::StringConverter::parseInt(working);
+   top_unit = Unit_Pixel;
+   top_set = true;
+  }
+ }
+ else if (key == "text-align")
+ {
+  if (S::matches_insensitive(working, "top"))
+   alignment.horz = Gorilla::TextAlign_Left;
+  else if (S::matches_insensitive(working, "center"))
+   alignment.horz = Gorilla::TextAlign_Centre;
+  else if (S::matches_insensitive(working, "centre"))
+   alignment.horz = Gorilla::TextAlign_Centre;
+  else if (S::matches_insensitive(working, "right"))
+   alignment.horz = Gorilla::TextAlign_Right;
+  alignment.horz_set = true;
+ }
+ else if (key == "vertical-align")
+ {
+  if (S::matches_insensitive(working, "top"))
+   alignment.vert = Gorilla::VerticalAlign_Top;
+  else if (S::matches_insensitive(working, "middle"))
+   alignment.vert = Gorilla::VerticalAlign_Middle;
+  else if (S::matches_insensitive(working, "bottom"))
+   alignment.vert = Gorilla::VerticalAlign_Bottom;
+  alignment.vert_set = true;
+ }
+ else if (key == "font")
+ {
+  font = Ogre::StringConverter::parseInt(working);
+  glyph_data = 0;
+  font_set = true;
+ }
+ else if (key == "border")
+ {
+   // <size> <all-colours>
+   Ogre::vector<Ogre::String>::type strs = Ogre::StringUtil::split(working, " ", 1);
+   
+   if (strs.size() == 1)
+   {
+    border.width = Ogre::StringConverter::parseInt(strs[0]);
+    border.width_set = true;
+   }
+   else if (strs.size() == 2)
+   {
+    border.width = Ogre::StringConverter::parseInt(strs[0]);
+    border.width_set = true;
+    Ogre::ColourValue col;
+    border.left = border.top = border.bottom = border.right = S::getCSSRGBAColour(strs[1]);
+    border.left_set = border.top_set = border.bottom_set = border.right_set = true;
+   }
+  
+ }
+ else if (key == "border-width")
+ {
+  border.width = Ogre::StringConverter::parseInt(working);
+  border.width_set = true;
+ }
+ else if (key == "border-top")
+ {
+  border.top = S::getCSSRGBAColour(working);
+  border.top_set = true;
+ }
+ else if (key == "border-right")
+ {
+  border.right = S::getCSSRGBAColour(working);
+  border.right_set = true;
+ }
+ else if (key == "border-bottom")
+ {
+  border.bottom = S::getCSSRGBAColour(working);
+  border.bottom_set = true;
+ }
+ else if (key == "border-left")
+ {
+  border.left = S::getCSSRGBAColour(working);
+  border.left_set = true;
+ }
+ else if (key == "background")
+ {
+  if (S::matches_insensitive(working, "none"))
+   background.type = Background::BT_Transparent;
+  else if (S::matches_insensitive(working, "transparent"))
+   background.type = Background::BT_Transparent;
+  background.set = true;
+ }
+ else if (key == "background-image")
+ {
+  background.type = Background::BT_Sprite;
+  background.sprite = working;
+  background.sprite_data = 0;
+  background.set = true;
+ }
+ else if (key == "background-colour" || key == "background-color")
+ {
+  background.type = Background::BT_Colour;
+  if (S::starts_insensitive(working, "rgb"))
+  {
+   background.colour = S::getCSSRGBAColour(working);
+  background.set = true;
+  }
+ }
+ else if (key == "pointer-events")
+ {
+  pointer_events = S::matches_insensitive(working, "none") == false;
+  pointer_events_set = true;
+ }
+ else if (key == "overflow")
+ {
+  overflow_hidden = S::matches_insensitive(working, "hidden") || S::matches_insensitive(working, "clip");
+  overflow_set = true;
+ }
+ else if (key == "colour" || key == "color")
+ {
+  if (S::starts_insensitive(working, "rgb"))
+  {
+   colour = S::getCSSRGBAColour(working);
+   colour_set = true;
+  }
+ }
+}
+
+void ElementStyle::merge(ElementStyle* other, bool isParent) const
+{
+ 
+ if (!isParent)
+ {
+    if (left_set)
+    {
+     other->left = left;
+     other->left_unit = left_unit;
+     other->left_set = true;
+    }
+ 
+    if (top_set)
+    {
+     other->top = top;
+     other->top_unit = top_unit;
+     other->top_set = true;
+    }
+ 
+    if (width_set)
+    {
+     other->width = width;
+     other->width_unit = width_unit;
+     other->width_set = true;
+    }
+ 
+    if (height_set)
+    {
+     other->height = height;
+     other->height_unit = height_unit;
+     other->height_set = true;
+    }
+    
+    if (overflow_set)
+    {
+     other->overflow_hidden = overflow_hidden;
+     other->overflow_set = true;
+    }
+ }
+ 
+ if (alignment.horz_set)
+ {
+  other->alignment.horz = alignment.horz;
+  other->alignment.horz_set = true;
+ }
+ 
+ if (alignment.vert_set)
+ {
+  other->alignment.vert = alignment.vert;
+  other->alignment.vert_set = true;
+ }
+ 
+ if (!isParent)
+ {
+   
+   if (background.set)
+   {
+    other->background.type = background.type;
+    other->background.colour = background.colour;
+    other->background.sprite = background.sprite;
+    other->background.sprite_data = background.sprite_data;
+    other->background.set = true;
+   }
+   
+   if (border.width_set)
+   {
+    other->border.width = border.width;
+    other->border.width_set = true;
+   }
+  
+   if (border.left_set)
+   {
+    other->border.left = border.left;
+    other->border.left_set = true;
+   }
+ 
+   if (border.top_set)
+   {
+    other->border.top = border.top;
+    other->border.top_set = true;
+   }
+ 
+   if (border.right_set)
+   {
+    other->border.right = border.right;
+    other->border.right_set = true;
+   }
+ 
+   if (border.bottom_set)
+   {
+    other->border.bottom = border.bottom;
+    other->border.bottom_set = true;
+   }
+ }
+ 
+ if (colour_set)
+ {
+  other->colour = colour;
+  other->colour_set = true;
+ }
+ 
+ if (pointer_events_set)
+ {
+  other->pointer_events = pointer_events;
+  other->pointer_events_set = true;
+ }
+ 
+ if (font_set)
+ {
+  other->font = font;
+  other->glyph_data = glyph_data;
+  other->font_set = true;
+ }
+ 
+}
+
+
+// ----------------------------------------------------------------------------------------------------------------
+
+
+Element::Element(const std::string& id_and_or_classes, PuzzleTree* tree, Element* parent, size_t index, int type, const ElementArgs& args, bool detached, const TemplateLook* look)
+: mTree(tree),
+  mParent(parent),
+  mRectangle(0),
+  mCaption(0),
+  mClippedSprite(0),
+  mIndex(index),
+  mState(ElementState_Normal),
+  mType(type),
+  mIsVisible(true),
+  mRecordsValid(false),
+  mListSource(0),
+  mListRowHeight(20),
+  mListScroll(0),
+  mListIndex(std::string::npos),
+  mListTop(0),
+  mCulled(false),
+  mCascadePending(false),
+  mDetached(detached),
+  mListening(false),
+  mVeiled(detached ? false : tree->mVeilNew),
+  mListener(0),
+  mDocument(0),
+  mDocumentNode(0),
+  mCascadeStamp(0),
+  mHitBox(std::string::npos),
+  mNavNode(std::string::npos)
+{
+ 
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ // Auto subscribe events if buttons, textboxes or OSK elements.
+ if (mType == ElementType_Button || mType == ElementType_TextBox || mType == ElementType_OSKSubmit || mType == ElementType_OSKCancel)
+ {
+  mListening = true;
+ }
+ else if (S::args_has(args, "listen"))
+ {
+  mListening = Ogre::StringConverter::parseBool(S::args_get(args, "listen", "false"));
+ }
+ 
+ // Title.
+ if (S::args_has(args, "title"))
+ {
+  mTitle = S::args_get(args, "title");
+ }
+ 
+ // List rows; "row" is the MAML id and classes given to each pooled row.
+ if (mType == ElementType_List)
+ {
+  mListRowClasses = S::args_get(args, "row", ".list-row");
+  if (S::args_has(args, "row-height"))
+   mListRowHeight = Ogre::StringConverter::parseReal(S::args_get(args, "row-height"));
+  if (mListRowHeight < 1)
+   mListRowHeight = 1;
+ }
+ 
+ // Kept so the element can be restyled.
+ if (look)
+ {
+  mStyles = look->styles;
+  mID = look->id;
+ }
+ else
+ {
+  _parseSelectors(id_and_or_classes);
+ }
+ 
+ // Opened once the ID is known; the scope copies it.
+ MONKEY_TRACE("construct", "element", &mID, mType);
+ 
+ mInlineStyle = S::args_get(args, "style");
+ mBinding = S::args_get(args, "bind");
+ mClassBinding = S::args_get(args, "bind-class");
+ 
+ // Detached elements are cascaded now, possibly on another thread, but registered and laid out on attach.
+ if (mDetached)
+ {
+  _cascade();
+  return;
+ }
+ 
+ _register();
+ 
+ if (mTree->mDeferCascade)
+ {
+  mCascadePending = true;
+  if (mParent == 0 || mParent->mCascadePending == false)
+   mTree->mDeferred.push_back(this);
+  return;
+ }
+ 
+ // A bound class is not part of the template's look.
+ if (look && mBoundClass.empty())
+ {
+  mLookNormal = look->normal;
+  mLookActive = look->active;
+  mLookHover = look->hover;
+  mCascadeStamp = ++mTree->mCascadeCount;
+ }
+ else
+ {
+  _cascade();
+ }
+ 
+ reapplyLook();
+ 
+}
+
+void Element::_cascade()
+{
+ 
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ MONKEY_PROFILE(mTree, cascade);
+ MONKEY_TRACE("cascade", "element", &mID, mType);
+ 
+ mCascadeStamp = ++mTree->mCascadeCount;
+ 
+ std::string selectors;
+ for (size_t i=0;i < mStyles.size();i++)
+  selectors.append(i ? " " + mStyles[i] : mStyles[i]);
+ 
+ mLookNormal.reset();
+ std::string str_type = mTree->getElementType(mType);
+ // Merge styles from known type.
+ if (mType != -1)
+ {
+  merge_style(str_type, &mLookNormal, false);
+ }
+ 
+ // Lists clip their rows unless a rule says otherwise.
+ if (mType == ElementType_List && mLookNormal.overflow_set == false)
+  mLookNormal.overflow_hidden = true;
+ 
+ refreshLook(&mLookNormal, selectors);
+ 
+ // Inline CSS.
+ if (mInlineStyle.length())
+ {
+  Ogre::vector<Ogre::String>::type  workings = Ogre::StringUtil::split(mInlineStyle, ";");
+  bool didCut = false;
+  S::StringPair sp;
+  for (size_t i=0;i < workings.size();i++)
+  {
+   S::trim(workings[i]);
+   if (workings[i].length() == 0)
+    continue;
+   
+   sp = S::cut(workings[i], didCut, ':', 0);
+   if (didCut)
+   {
+    S::lower(sp.first);
+    mLookNormal.from_css(sp.first, sp.second);
+   }
+  }
+ }
+ 
+ mTree->_resolveStyle(&mLookNormal, selectors);
+ 
+ mLookActive.reset();
+ merge_style(&mLookNormal, &mLookActive, false);
+ mLookHover.reset();
+ merge_style(&mLookNormal, &mLookHover, false);
+ 
+ merge_style(str_type + ":hover", &mLookHover, false);
+ if (mID.length())
+  merge_style("#" + mID + ":hover", &mLookHover, false);
+ 
+ merge_style(str_type + ":active", &mLookActive, false);
+ if (mID.length())
+  merge_style("#" + mID + ":active", &mLookActive, false);
+ 
+ // The merges only carry glyph data and sprites the rules set themselves.
+ mTree->_resolveStyle(&mLookHover, selectors);
+ mTree->_resolveStyle(&mLookActive, selectors);
+ 
+}
+
+void Element::_register()
+{
+ 
+ if (mListening)
+  listen();
+ 
+ // Make this element a singleton if a OSK element.
+ if (mType > ElementType_OSK_BEGIN && mType < ElementType_OSK_END)
+ {
+  mTree->mSingletonElements[mType] = this;
+ }
+ 
+ if (mType == ElementType_List)
+  mTree->mListElements.push_back(this);
+ 
+ if (mBinding.length() || mClassBinding.length())
+  mTree->_bind(this);
+ 
+}
+
+bool Element::isDescendantOf(const Element* ancestor) const
+{
+ for (const Element* elem = this; elem; elem = elem->mParent)
+  if (elem == ancestor)
+   return true;
+ return false;
+}
+
+void Element::_restyleUsing(const std::set<Ogre::String>& names)
+{
+ 
+ Ogre::String type = mTree->getElementType(mType);
+ bool uses = names.count(type) || names.count(type + ":hover") || names.count(type + ":active");
+ for (size_t i=0;i < mStyles.size() && uses == false;i++)
+  uses = names.count(mStyles[i]) != 0;
+ if (uses == false && mID.length())
+  uses = names.count("#" + mID + ":hover") || names.count("#" + mID + ":active");
+ if (uses == false && mParent)
+  uses = names.count("#" + mParent->getID() + ":child") != 0;
+ 
+ // Children inherit, so they are restyled with it.
+ if (uses)
+ {
+  restyle();
+  return;
+ }
+ 
+ for (std::multimap<Ogre::String, Element*>::iterator it = mChildren.begin(); it != mChildren.end(); it++)
+  (*it).second->_restyleUsing(names);
+ 
+}
+
+void Element::_parseSelectors(const std::string& id_and_or_classes)
+{
+ 
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ mStyles.clear();
+ Ogre::vector<Ogre::String>::type selectors = Ogre::StringUtil::split(S::maml_id_css_expand(id_and_or_classes), " ");
+ for (size_t i=0;i < selectors.size();i++)
+ {
+  if (selectors[i].length() == 0)
+   continue;
+  mStyles.push_back(selectors[i]);
+  if (selectors[i][0] == '#' && S::has(selectors[i], ':') == false)
+   mID = S::slice_copy(selectors[i], 1);
+ }
+ 
+ if (mBoundClass.length())
+  mStyles.push_back(mBoundClass);
+ 
+}
+
+void Element::_setBoundClass(const Ogre::String& value, bool restyle)
+{
+ 
+ Ogre::String cls = value.length() ? "." + value : value;
+ if (cls == mBoundClass)
+  return;
+ 
+ std::vector<Ogre::String>::iterator it = std::find(mStyles.begin(), mStyles.end(), mBoundClass);
+ if (mBoundClass.length() && it != mStyles.end())
+  mStyles.erase(it);
+ if (cls.length())
+  mStyles.push_back(cls);
+ mBoundClass = cls;
+ 
+ if (restyle)
+  this->restyle();
+ 
+}
+
+void Element::_unveil()
+{
+ 
+ mVeiled = false;
+ mTree->mHitBoxesDirty = true;
+ 
+ if (mIsVisible && mCulled == false && mRecordsValid)
+  _applyRecord(mRecords[mState], RecordDelta_Background | RecordDelta_Border | RecordDelta_Text);
+ 
+ for (std::multimap<Ogre::String, Element*>::iterator it = mChildren.begin(); it != mChildren.end(); it++)
+  (*it).second->_unveil();
+ 
+}
+
+void Element::_attach()
+{
+ mDetached = false;
+ Ogre::String boundClass = mBoundClass;
+ _register();
+ // Cascaded while detached, without the bound class.
+ if (boundClass != mBoundClass)
+  _restyle();
+ mTree->mElements.insert(std::pair<Ogre::String, Element*>(mID, this));
+ for (std::multimap<Ogre::String, Element*>::iterator it = mChildren.begin(); it != mChildren.end(); it++)
+  (*it).second->_attach();
+}
+
+void Element::_cascadePending(std::vector<Element*>& children)
+{
+ _cascade();
+ mCascadePending = false;
+ for (std::multimap<Ogre::String, Element*>::iterator it = mChildren.begin(); it != mChildren.end(); it++)
+  children.push_back((*it).second);
+}
+
+void Element::_restyle()
+{
+ _cascade();
+ for (std::multimap<Ogre::String, Element*>::iterator it = mChildren.begin(); it != mChildren.end(); it++)
+  (*it).second->_restyle();
+}
+
+void Element::restyle()
+{
+ _restyle();
+ reapplyLook();
+}
+
+bool Element::hasClass(const Ogre::String& name) const
+{
+ Ogre::String cls = (name.length() && name[0] == '.') ? name : "." + name;
+ return std::find(mStyles.begin(), mStyles.end(), cls) != mStyles.end();
+}
+
+void Element::addClass(const Ogre::String& name)
+{
+ if (name.length() == 0 || hasClass(name))
+  return;
+ mStyles.push_back(name[0] == '.' ? name : "." + name);
+ restyle();
+}
+
+void Element::removeClass(const Ogre::String& name)
+{
+ Ogre::String cls = (name.length() && name[0] == '.') ? name : "." + name;
+ std::vector<Ogre::String>::iterator it = std::find(mStyles.begin(), mStyles.end(), cls);
+ if (it == mStyles.end())
+  return;
+ mStyles.erase(it);
+ restyle();
+}
+
+Element::~Element()
+{
+ 
+ // Each child unlinks itself from mChildren.
+ while (mChildren.empty() == false)
+  delete (*mChildren.begin()).second;
+ 
+ if (mRectangle)
+  mTree->_destroyRectangle(mRectangle);
+ if (mCaption)
+  mTree->_destroyCaption(mCaption);
+ delete mClippedSprite;
+ 
+ if (mParent)
+ {
+  for (std::multimap<Ogre::String, Element*>::iterator it = mParent->mChildren.begin(); it != mParent->mChildren.end(); it++)
+  {
+   if ((*it).second == this)
+   {
+    mParent->mChildren.erase(it);
+    break;
+   }
+  }
+  std::vector<Element*>::iterator row = std::find(mParent->mListRows.begin(), mParent->mListRows.end(), this);
+  if (row != mParent->mListRows.end())
+   mParent->mListRows.erase(row);
+ }
+ 
+ mTree->_forgetElement(this);
+ 
+}
+
+void Element::merge_style(const std::string& name, ElementStyle* style, bool isParent)
+{
+ if (style == 0)
+  return;
+ if (name.length() == 0)
+  return;
+ const ElementStyle* a = 0;
+ a = mTree->_findStyle(name);
+ if (a)
+  merge_style(a, style, isParent);
+}
+
+void Element::refreshLook(ElementStyle* look, const Ogre::String& id_and_or_classes)
+{
+ 
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ std::string classes;
+ classes.append(id_and_or_classes);
+ 
+ // Allow for a child's style based on parent-child order...thing.
+ if (mParent != 0)
+ {
+  merge_style(mParent->getNormalStyle(), look, true);
+  classes.append(" #" + mParent->getID() + ":child");   // '#parent:child'
+ }
+ 
+ Ogre::vector<Ogre::String>::type strs = Ogre::StringUtil::split(classes, " ");
+ Ogre::String name;
+ 
+ for (size_t i=0;i < strs.size();i++)
+ {
+  
+  if (strs[i].length() == 0)
+   continue;
+  
+  if (strs[i][0] == '#' && S::has(strs[i], ':') == false)
+   mID = S::slice_copy(strs[i], 1);
+    
+  const ElementStyle* style = 0;
+  
+  style = mTree->_findStyle(strs[i]);
+  
+  if (style == 0)
+   continue;
+  
+  merge_style(style, look, false);
+  
+ }
+ 
+}
+
+void Element::debug(size_t index)
+{
+ for (size_t i=0;i < index;i++)
+  std::cout << " ";
+  
+ std::cout << "+ " << mID << "," << mIndex << "," << mTree->getElementType(mType) << ")\n";
+ for (std::multimap<Ogre::String, Element*>::iterator it = mChildren.begin(); it != mChildren.end(); it++)
+  (*it).second->debug(index + 1);
+}
+
+void Element::getMemoryUsage(MemoryUsage& usage) const
+{
+ 
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ usage.elements += sizeof(Element) - 3 * sizeof(ElementStyle);
+ if (mClippedSprite)
+  usage.elements += sizeof(Gorilla::Sprite);
+ usage.looks += 3 * sizeof(ElementStyle);
+ 
+ usage.strings += S::stringBytes(mID) + S::stringBytes(mText) + S::stringBytes(mTitle) + S::stringBytes(mListRowClasses);
+ usage.strings += S::stringBytes(mInlineStyle) + S::stringBytes(mBinding) + S::stringBytes(mClassBinding) + S::stringBytes(mBoundClass);
+ usage.strings += S::styleStringBytes(mLookNormal) + S::styleStringBytes(mLookHover) + S::styleStringBytes(mLookActive);
+ for (size_t i=0;i < mStyles.size();i++)
+  usage.strings += S::stringBytes(mStyles[i]);
+ 
+ // This element's entry in the tree's index, its children's entries and its own vectors.
+ usage.containers += (1 + mChildren.size()) * S::mapNodeBytes<std::pair<const Ogre::String, Element*> >();
+ usage.strings += (mParent ? 2 : 1) * S::stringBytes(mID);
+ usage.containers += mStyles.capacity() * sizeof(Ogre::String) + mListRows.capacity() * sizeof(Element*);
+ 
+ if (std::find(mTree->mMouseListenerElements.begin(), mTree->mMouseListenerElements.end(), this) != mTree->mMouseListenerElements.end())
+  usage.listeners += sizeof(Element*);
+ 
+ if (mRectangle)
+  usage.primitives += mTree->mBackend->getPrimitiveBytes(mRectangle);
+ if (mCaption)
+  usage.primitives += mTree->mBackend->getPrimitiveBytes(mCaption);
+ 
+ for (std::multimap<Ogre::String, Element*>::const_iterator it = mChildren.begin(); it != mChildren.end(); it++)
+  (*it).second->getMemoryUsage(usage);
+ 
+}
+
+Element* Element::intersectionTest(int left, int top)
+{
+ mTree->mFrameStats.hit_test_elements_visited++;
+ 
+ if (mRecordsValid == false || mIsVisible == false || mCulled || mVeiled)
+  return 0;
+ 
+ if (left < mClip.left || left >= mClip.right || top < mClip.top || top >= mClip.bottom)
+  return 0;
+ 
+ const RenderRecord& record = mRecords[mState];
+ if (left < record.left || left >= record.left + record.width || top < record.top || top >= record.top + record.height)
+  return 0;
+ 
+ Element* childRet = 0;
+ for (std::multimap<Ogre::String, Element*>::iterator it = mChildren.begin(); it != mChildren.end(); it++)
+ {
+  childRet = (*it).second->intersectionTest(left, top);
+  if (childRet != 0)
+   return childRet;
+ }
+ 
+ return mLookNormal.pointer_events ? this : 0;
+}
+
+Element* Element::createChild(const std::string& id_and_or_classes, int type, const ElementArgs& args)
+{
+ return _createChild(id_and_or_classes, type, args, 0);
+}
+
+Element* Element::_createChild(const std::string& id_and_or_classes, int type, const ElementArgs& args, const TemplateLook* look)
+{
+ size_t index = mIndex + 1;
+ if (index >= 14)
+  index = 14;
+ Element* elem = new Element(id_and_or_classes, mTree, this, index, type, args, mDetached, look);
+ if (mDetached == false)
+  mTree->mElements.insert(std::pair<Ogre::String, Element*>(elem->getID(), elem));
+ mChildren.insert(std::pair<Ogre::String, Element*>(elem->getID(), elem));
+ return elem;
+}
+
+void Element::reapplyLook()
+{
+ 
+ // Laid out once cascaded and attached.
+ if (mCascadePending || mDetached)
+  return;
+ 
+ MONKEY_PROFILE(mTree, layout);
+ MONKEY_TRACE("layout", "element", &mID, mType);
+ mTree->mFrameStats.reapply_looks++;
+ 
+ if (mIsVisible == false)
+ {
+  if (mRectangle)
+  {
+   mTree->_destroyRectangle(mRectangle);
+   mRectangle = 0;
+  }
+  if (mCaption)
+  {
+   mTree->_destroyCaption(mCaption);
+   mCaption = 0;
+  }
+  mTree->_touchHitBox(this);
+  return;
+ }
+ 
+ _computeRecord(&mLookNormal, mRecords[ElementState_Normal]);
+ _computeRecord(&mLookActive, mRecords[ElementState_Active]);
+ _computeRecord(&mLookHover, mRecords[ElementState_Hover]);
+ 
+ for (size_t from=0;from < 3;from++)
+  for (size_t to=0;to < 3;to++)
+   mRecordDeltas[from][to] = mRecords[from].compare(mRecords[to]);
+ 
+ mRecordsValid = true;
+ 
+ _updateClip();
+ 
+ const RenderRecord& record = mRecords[mState];
+ 
+ // Nothing of this subtree can be seen; drop its primitives and don't lay out the children.
+ if (record.left >= mClip.right || record.top >= mClip.bottom ||
+     record.left + record.width <= mClip.left || record.top + record.height <= mClip.top ||
+     record.width <= 0 || record.height <= 0)
+ {
+  mTree->mFrameStats.elements_culled += _cull();
+  return;
+ }
+ 
+ mCulled = false;
+ 
+ mTree->mFrameStats.elements_laid_out++;
+ 
+ _applyRecord(mRecords[mState], RecordDelta_All);
+ mTree->_touchHitBox(this);
+ 
+ if (mListSource)
+  _layoutList(false);
+ 
+ for (std::multimap<Ogre::String, Element*>::iterator it = mChildren.begin(); it != mChildren.end(); it++)
+  (*it).second->reapplyLook();
+ 
+}
+
+void Element::_updateClip()
+{
+ 
+ if (mParent)
+ {
+  mClip = mParent->mChildClip;
+ }
+ else
+ {
+  mClip.left = 0;
+  mClip.top = 0;
+  mClip.right = mTree->mBackend->getWidth();
+  mClip.bottom = mTree->mBackend->getHeight();
+ }
+ 
+ const RenderRecord& record = mRecords[mState];
+ mChildClip = mClip;
+ if (record.look->overflow_hidden)
+ {
+  mChildClip.left = std::max(mChildClip.left, record.left);
+  mChildClip.top = std::max(mChildClip.top, record.top);
+  mChildClip.right = std::min(mChildClip.right, record.left + record.width);
+  mChildClip.bottom = std::min(mChildClip.bottom, record.top + record.height);
+ }
+ 
+}
+
+void Element::_computeRecord(ElementStyle* style, RenderRecord& record)
+{
+ 
+ record.look = style;
+ record.has_rectangle = (style->background.type != ElementStyle::Background::BT_Transparent || style->border.width != 0);
+ 
+ // Hover and active looks are merged from the normal look, so unless a state rule moves
+ // or resizes the element the layout can be shared.
+ if (style != &mLookNormal &&
+     style->left == mLookNormal.left && style->left_unit == mLookNormal.left_unit &&
+     style->top == mLookNormal.top && style->top_unit == mLookNormal.top_unit &&
+     style->width == mLookNormal.width && style->width_unit == mLookNormal.width_unit &&
+     style->height == mLookNormal.height && style->height_unit == mLookNormal.height_unit)
+ {
+  record.left = mRecords[ElementState_Normal].left;
+  record.top = mRecords[ElementState_Normal].top;
+  record.width = mRecords[ElementState_Normal].width;
+  record.height = mRecords[ElementState_Normal].height;
+  return;
+ }
+ 
+ float left = 0, top = 0, width = 0, height = 0, parentWidth = 0, parentHeight = 0, parentLeft = 0, parentTop = 0;
+ 
+ if (mParent)
+ {
+  parentWidth = mParent->getScreenWidth();
+  parentHeight = mParent->getScreenHeight();
+  parentLeft = mParent->getScreenLeft();
+  parentTop = mParent->getScreenTop();
+ }
+ else
+ {
+  parentWidth = mTree->mBackend->getWidth();
+  parentHeight = mTree->mBackend->getHeight();
+  parentLeft = 0;
+  parentTop = 0;
+ }
+ 
+ if (style->left_unit == Unit_Pixel)
+  left = style->left;
+ else if (style->left_unit == Unit_Percent)
+  left = style->left * parentWidth;
+ else if (style->left_unit == Unit_AlignRight)
+  left = parentWidth;
+ 
+ if (style->width_unit == Unit_Pixel)
+  width = style->width;
+ else
+  width = style->width * parentWidth;
+ 
+ if (left + width > parentWidth)
+ {
+  if (style->left_unit == Unit_AlignRight)
+   left -= (left + width) - parentWidth;
+  else
+   width -= (left + width) - parentWidth;
+ }
+
+ if (style->top_unit == Unit_Pixel)
+  top = style->top;
+ else if (style->top_unit == Unit_Percent)
+  top = style->top * parentHeight;
+ else if (style->top_unit == Unit_AlignRight)
+  top = parentHeight;
+ 
+ if (style->height_unit == Unit_Pixel)
+  height = style->height;
+ else
+  height = style->height * parentHeight;
+ 
+ if (top + height > parentHeight)
+ {
+  if (style->top_unit == Unit_AlignRight)
+   top -= (top + height) - parentHeight;
+  else
+   height -= (top + height) - parentHeight;
+ }
+
+ if (style->left_unit == Unit_AlignCenter)
+ {
+  left = (parentWidth * 0.5) - (width * 0.5f);
+  if (left + width > parentWidth)
+   width -= (left + width) - parentWidth;
+ }
+ 
+ if (style->top_unit == Unit_AlignCenter)
+ {
+  top = (parentHeight * 0.5) - (height * 0.5f);
+  if (top + height > parentHeight)
+   height -= (top + height) - parentHeight;
+ }
+ 
+ // A list row is placed by its list rather than its look; see _layoutList.
+ if (mParent && mListIndex != std::string::npos)
+ {
+  top = mListTop;
+  height = mParent->mListRowHeight;
+ }
+ 
+ record.left = left + parentLeft;
+ record.top = top + parentTop;
+ record.width = width;
+ record.height = height;
+}
+
+void Element::_applyRecord(const RenderRecord& unclipped, unsigned int delta)
+{
+ 
+ ElementStyle* style = unclipped.look;
+ 
+ // Partly clipped; trim the box to the clip rectangle. Sprites are cropped by their texture coordinates.
+ RenderRecord record = unclipped;
+ bool clipped = _clipContains(record) == false;
+ if (clipped)
+ {
+  float right = std::min(record.left + record.width, mClip.right),
+        bottom = std::min(record.top + record.height, mClip.bottom);
+  record.left = std::max(record.left, mClip.left);
+  record.top = std::max(record.top, mClip.top);
+  record.width = right - record.left;
+  record.height = bottom - record.top;
+ }
+ 
+ if (mText.length() != 0)
+ {
+  unsigned int captionDelta = delta;
+  if (mCaption == 0 && style->glyph_data == 0)
+  {
+   // Unknown font; already reported by _resolveStyle.
+   captionDelta = RecordDelta_None;
+  }
+  else if (mCaption == 0)
+  {
+   mCaption = mTree->_createCaption(mIndex, style->font, record.left, record.top, mVeiled ? Ogre::StringUtil::BLANK : mText);
+   captionDelta = RecordDelta_All;
+  }
+  
+  // Painted by _unveil.
+  if (mVeiled)
+   captionDelta &= ~RecordDelta_Text;
+  
+  if (captionDelta & RecordDelta_Text)
+  {
+   mCaption->font(style->font);
+   mCaption->colour(style->colour);
+   mCaption->align(style->alignment.horz, style->alignment.vert);
+   mCaption->text(mText);
+   mTree->mFrameStats.primitive_setter_calls += 4;
+  }
+  
+  if (captionDelta & RecordDelta_Geometry)
+  {
+   mCaption->position(record.left, record.top);
+   mCaption->size(record.width, record.height);
+   mTree->mFrameStats.primitive_setter_calls += 2;
+  }
+ }
+ else if (mCaption != 0)
+ {
+  mTree->_destroyCaption(mCaption);
+  mCaption = 0;
+ }
+ 
+ if (record.has_rectangle)
+ {
+  unsigned int rectangleDelta = delta;
+  if (mRectangle == 0)
+  {
+   mRectangle = mTree->_createRectangle(mIndex, record.left, record.top, record.width, record.height);
+   rectangleDelta = RecordDelta_All;
+  }
+  
+  // The crop follows the box.
+  if (style->background.type == ElementStyle::Background::BT_Sprite && (rectangleDelta & RecordDelta_Geometry))
+   rectangleDelta |= RecordDelta_Background;
+  
+  if (mVeiled && (rectangleDelta & (RecordDelta_Background | RecordDelta_Border)))
+  {
+   mRectangle->no_background();
+   mRectangle->no_border();
+   mTree->mFrameStats.primitive_setter_calls += 2;
+   rectangleDelta &= ~(RecordDelta_Background | RecordDelta_Border);
   }
-  else
+  
+  if (rectangleDelta & RecordDelta_Background)
   {
-   top = Ogre::StringConverter::parseInt(working);
-   top_unit = Unit_Pixel;
-   top_set = true;
+   if (style->background.type == ElementStyle::Background::BT_Colour)
+    mRectangle->background_colour(style->background.colour);
+   else if (style->background.type == ElementStyle::Background::BT_Sprite)
+    mRectangle->background_image(clipped ? _clipSprite(style->background.sprite_data, unclipped, record) : style->background.sprite_data);
+   else
+    mRectangle->no_background();
+   mTree->mFrameStats.primitive_setter_calls++;
+  }
+  
+  if (rectangleDelta & RecordDelta_Border)
+  {
+   if (style->border.width == 0)
+    mRectangle->no_border();
+   else
+    mRectangle->border(style->border.width, style->border.top, style->border.right, style->border.bottom, style->border.left);
+   mTree->mFrameStats.primitive_setter_calls++;
+  }
+  
+  if (rectangleDelta & RecordDelta_Geometry)
+  {
+   mRectangle->position(record.left, record.top);
+   mRectangle->size(record.width, record.height);
+   mTree->mFrameStats.primitive_setter_calls += 2;
   }
  }
- else if (key == "text-align")
+ else if (mRectangle)
  {
-  if (S::matches_insensitive(working, "top"))
-   alignment.horz = Gorilla::TextAlign_Left;
-  else if (S::matches_insensitive(working, "center"))
-   alignment.horz = Gorilla::TextAlign_Centre;
-  else if (S::matches_insensitive(working, "centre"))
-   alignment.horz = Gorilla::TextAlign_Centre;
-  else if (S::matches_insensitive(working, "right"))
-   alignment.horz = Gorilla::TextAlign_Right;
-  alignment.horz_set = true;
+  mTree->_destroyRectangle(mRectangle);
+  mRectangle = 0;
  }
- else if (key == "vertical-align")
+ 
+}
+
+Gorilla::Sprite* Element::_clipSprite(Gorilla::Sprite* sprite, const RenderRecord& unclipped, const RenderRecord& record)
+{
+ 
+ if (sprite == 0 || unclipped.width <= 0 || unclipped.height <= 0)
+  return sprite;
+ 
+ if (mClippedSprite == 0)
+  mClippedSprite = new Gorilla::Sprite();
+ *mClippedSprite = *sprite;
+ 
+ float u = (sprite->uvRight - sprite->uvLeft) / unclipped.width,
+       v = (sprite->uvBottom - sprite->uvTop) / unclipped.height;
+ mClippedSprite->uvLeft = sprite->uvLeft + (record.left - unclipped.left) * u;
+ mClippedSprite->uvRight = mClippedSprite->uvLeft + record.width * u;
+ mClippedSprite->uvTop = sprite->uvTop + (record.top - unclipped.top) * v;
+ mClippedSprite->uvBottom = mClippedSprite->uvTop + record.height * v;
+ mClippedSprite->spriteWidth = sprite->spriteWidth * record.width / unclipped.width;
+ mClippedSprite->spriteHeight = sprite->spriteHeight * record.height / unclipped.height;
+ return mClippedSprite;
+ 
+}
+
+bool Element::_clipContains(const RenderRecord& record) const
+{
+ return record.left >= mClip.left && record.top >= mClip.top &&
+        record.left + record.width <= mClip.right && record.top + record.height <= mClip.bottom;
+}
+
+size_t Element::_cull()
+{
+ 
+ size_t count = 1;
+ mCulled = true;
+ mTree->_touchHitBox(this);
+ 
+ if (mRectangle)
  {
-  if (S::matches_insensitive(working, "top"))
-   alignment.vert = Gorilla::VerticalAlign_Top;
-  else if (S::matches_insensitive(working, "middle"))
-   alignment.vert = Gorilla::VerticalAlign_Middle;
-  else if (S::matches_insensitive(working, "bottom"))
-   alignment.vert = Gorilla::VerticalAlign_Bottom;
-  alignment.vert_set = true;
+  mTree->_destroyRectangle(mRectangle);
+  mRectangle = 0;
  }
- else if (key == "font")
+ 
+ if (mCaption)
  {
-  font = Ogre::StringConverter::parseInt(working);
-  font_set = true;
+  mTree->_destroyCaption(mCaption);
+  mCaption = 0;
  }
- else if (key == "border")
+ 
+ for (std::multimap<Ogre::String, Element*>::iterator it = mChildren.begin(); it != mChildren.end(); it++)
+  count += (*it).second->_cull();
+ 
+ return count;
+}
+
+void Element::_translate(float x, float y)
+{
+ 
+ mTree->mHitBoxesDirty = true;
+ 
+ bool contained = _clipContains(mRecords[mState]);
+ 
+ for (size_t i=0;i < 3;i++)
  {
-   // <size> <all-colours>
-   Ogre::vector<Ogre::String>::type strs = Ogre::StringUtil::split(working, " ", 1);
-   
-   if (strs.size() == 1)
-   {
-    border.width = Ogre::StringConverter::parseInt(strs[0]);
-    border.width_set = true;
-   }
-   else if (strs.size() == 2)
-   {
-    border.width = Ogre::StringConverter::parseInt(strs[0]);
-    border.width_set = true;
-    Ogre::ColourValue col;
-    border.left = border.top = border.bottom = border.right = S::getCSSRGBAColour(strs[1]);
-    border.left_set = border.top_set = border.bottom_set = border.right_set = true;
-   }
-  
+  mRecords[i].left += x;
+  mRecords[i].top += y;
  }
- else if (key == "border-width")
+ 
+ // The parent has moved first, so the clips follow it; anything that is or becomes clipped is
+ // laid out again rather than moved.
+ _updateClip();
+ const RenderRecord& record = mRecords[mState];
+ if (mCulled || contained == false || _clipContains(record) == false)
  {
-  border.width = Ogre::StringConverter::parseInt(working);
-  border.width_set = true;
+  reapplyLook();
+  return;
  }
- else if (key == "border-top")
+ 
+ if (mRectangle)
  {
-  border.top = S::getCSSRGBAColour(working);
-  border.top_set = true;
+  mRectangle->position(record.left, record.top);
+  mTree->mFrameStats.primitive_setter_calls++;
  }
- else if (key == "border-right")
+ 
+ if (mCaption)
  {
-  border.right = S::getCSSRGBAColour(working);
-  border.right_set = true;
+  mCaption->position(record.left, record.top);
+  mTree->mFrameStats.primitive_setter_calls++;
  }
- else if (key == "border-bottom")
+ 
+ for (std::multimap<Ogre::String, Element*>::iterator it = mChildren.begin(); it != mChildren.end(); it++)
+  (*it).second->_translate(x, y);
+ 
+}
+
+void Element::setListSource(ListSource* source)
+{
+ mListSource = source;
+ mListScroll = 0;
+ refreshList();
+}
+
+void Element::setListScroll(float pixels)
+{
+ mListScroll = pixels;
+ _layoutList(true);
+}
+
+void Element::refreshList()
+{
+ for (size_t i=0;i < mListRows.size();i++)
+  mListRows[i]->mListIndex = std::string::npos;
+ _layoutList(true);
+}
+
+void Element::_layoutList(bool apply)
+{
+ 
+ if (mListSource == 0 || mIsVisible == false || mRecordsValid == false)
+  return;
+ 
+ float height = getScreenHeight();
+ size_t rowCount = mListSource->getRowCount(this);
+ 
+ float maxScroll = float(rowCount) * mListRowHeight - height;
+ if (mListScroll > maxScroll)
+  mListScroll = maxScroll;
+ if (mListScroll < 0)
+  mListScroll = 0;
+ 
+ // Enough rows to cover the list when the first one is partly scrolled out.
+ size_t poolSize = size_t(Ogre::Math::Ceil(height / mListRowHeight)) + 1;
+ while (mListRows.size() < poolSize)
  {
-  border.bottom = S::getCSSRGBAColour(working);
-  border.bottom_set = true;
+  Element* row = createChild(mListRowClasses, ElementType_Block);
+  row->hide();
+  mListRows.push_back(row);
  }
- else if (key == "border-left")
+ 
+ size_t first = size_t(mListScroll / mListRowHeight);
+ 
+ for (size_t i=0;i < mListRows.size();i++)
  {
-  border.left = S::getCSSRGBAColour(working);
-  border.left_set = true;
+  size_t index = first + i;
+  Element* row = mListRows[index % mListRows.size()];
+  
+  if (index >= rowCount)
+  {
+   row->mListIndex = std::string::npos;
+   if (row->mIsVisible)
+    row->hide();
+   continue;
+  }
+  
+  float top = float(index) * mListRowHeight - mListScroll;
+  
+  // Still showing the same row and stays fully inside the list; just move its primitives.
+  if (apply && row->mListIndex == index && row->mIsVisible && row->mRecordsValid && row->mCulled == false)
+  {
+   RenderRecord moved = row->mRecords[row->mState];
+   moved.top += top - row->mListTop;
+   if (row->_clipContains(row->mRecords[row->mState]) && row->_clipContains(moved))
+   {
+    row->_translate(0, top - row->mListTop);
+    row->mListTop = top;
+    continue;
+   }
+  }
+  
+  row->mListTop = top;
+  
+  if (row->mListIndex != index)
+  {
+   row->mListIndex = index;
+   mListSource->bindRow(this, row, index);
+  }
+  
+  if (row->mIsVisible == false)
+   row->show();
+  else if (apply)
+   row->reapplyLook();
  }
- else if (key == "background")
+ 
+}
+
+unsigned int RenderRecord::compare(const RenderRecord& other) const
+{
+ 
+ unsigned int delta = RecordDelta_None;
+ 
+ if (left != other.left || top != other.top || width != other.width || height != other.height)
+  delta |= RecordDelta_Geometry;
+ 
+ if (has_rectangle != other.has_rectangle)
+  delta |= RecordDelta_Primitives;
+ 
+ if (look == other.look)
+  return delta;
+ 
+ const ElementStyle::Background& a = look->background, &b = other.look->background;
+ if (a.type != b.type ||
+    (a.type == ElementStyle::Background::BT_Colour && a.colour != b.colour) ||
+    (a.type == ElementStyle::Background::BT_Sprite && a.sprite_data != b.sprite_data))
+  delta |= RecordDelta_Background;
+ 
+ const ElementStyle::Border& c = look->border, &d = other.look->border;
+ if (c.width != d.width || c.top != d.top || c.right != d.right || c.bottom != d.bottom || c.left != d.left)
+  delta |= RecordDelta_Border;
+ 
+ if (look->colour != other.look->colour || look->font != other.look->font ||
+     look->alignment.horz != other.look->alignment.horz || look->alignment.vert != other.look->alignment.vert)
+  delta |= RecordDelta_Text;
+ 
+ return delta;
+}
+
+
+// ----------------------------------------------------------------------------------------------------------------
+
+namespace SecretMonkey
+{
+
+class GorillaRectangle : public RenderRectangle
+{
+ public:
+  
+  GorillaRectangle(Gorilla::Layer* layer, Gorilla::Rectangle* rectangle) : mLayer(layer), mRectangle(rectangle) {}
+  
+  void position(float left, float top)                 { mRectangle->position(left, top); }
+  void size(float width, float height)                 { mRectangle->width(width); mRectangle->height(height); }
+  void background_colour(const Ogre::ColourValue& col) { mRectangle->background_colour(col); }
+  void background_image(Gorilla::Sprite* sprite)       { mRectangle->background_image(sprite); }
+  void no_background()                                 { mRectangle->no_background(); }
+  void no_border()                                     { mRectangle->no_border(); }
+  void border(float width, const Ogre::ColourValue& top, const Ogre::ColourValue& right, const Ogre::ColourValue& bottom, const Ogre::ColourValue& left)
+  {
+   mRectangle->border(width, top, right, bottom, left);
+  }
+  
+  Gorilla::Layer*      mLayer;
+  Gorilla::Rectangle*  mRectangle;
+};
+
+class GorillaCaption : public RenderCaption
+{
+ public:
+  
+  GorillaCaption(Gorilla::Layer* layer, Gorilla::Caption* caption) : mLayer(layer), mCaption(caption) {}
+  
+  void position(float left, float top)                 { mCaption->left(left); mCaption->top(top); }
+  void size(float width, float height)                 { mCaption->width(width); mCaption->height(height); }
+  void font(size_t font)                               { mCaption->font(font); }
+  void colour(const Ogre::ColourValue& col)            { mCaption->colour(col); }
+  void text(const Ogre::String& text)                  { mCaption->text(text); }
+  void align(Gorilla::TextAlignment horz, Gorilla::VerticalAlignment vert)
+  {
+   mCaption->align(horz);
+   mCaption->vertical_align(vert);
+  }
+  
+  Gorilla::Layer*      mLayer;
+  Gorilla::Caption*    mCaption;
+};
+
+} // namespace SecretMonkey
+
+GorillaBackend::GorillaBackend(Ogre::Viewport* viewport)
+: mScreen(0),
+  mViewport(viewport)
+{
+ mSilverback = Gorilla::Silverback::getSingletonPtr();
+ 
+ if (mSilverback == 0)
+  mSilverback = new Gorilla::Silverback();
+}
+
+GorillaBackend::~GorillaBackend()
+{
+ if (mScreen)
+  mSilverback->destroyScreen(mScreen);
+}
+
+float GorillaBackend::getWidth() const
+{
+ return mScreen->getWidth();
+}
+
+float GorillaBackend::getHeight() const
+{
+ return mScreen->getHeight();
+}
+
+void GorillaBackend::loadAtlas(const Ogre::String& atlas)
+{
+ mSilverback->loadAtlas(atlas);
+ mScreen = mSilverback->createScreen(mViewport, atlas);
+ 
+ for (size_t i=0;i < 16;i++)
+  mLayers[i] = mScreen->createLayer(i);
+}
+
+Gorilla::Sprite* GorillaBackend::getSprite(const Ogre::String& name)
+{
+ return mScreen->getAtlas()->getSprite(name);
+}
+
+Gorilla::GlyphData* GorillaBackend::getGlyphData(size_t font)
+{
+ return mScreen->getAtlas()->getGlyphData(font);
+}
+
+RenderRectangle* GorillaBackend::createRectangle(size_t layer, float left, float top, float width, float height)
+{
+ return new SecretMonkey::GorillaRectangle(mLayers[layer], mLayers[layer]->createRectangle(left, top, width, height));
+}
+
+void GorillaBackend::destroyRectangle(RenderRectangle* rectangle)
+{
+ SecretMonkey::GorillaRectangle* rect = static_cast<SecretMonkey::GorillaRectangle*>(rectangle);
+ rect->mLayer->destroyRectangle(rect->mRectangle);
+ delete rect;
+}
+
+RenderCaption* GorillaBackend::createCaption(size_t layer, size_t font, float left, float top, const Ogre::String& text)
+{
+ Gorilla::Caption* caption = mLayers[layer]->createCaption(font, left, top, text);
+ caption->no_background();
+ return new SecretMonkey::GorillaCaption(mLayers[layer], caption);
+}
+
+void GorillaBackend::destroyCaption(RenderCaption* caption)
+{
+ SecretMonkey::GorillaCaption* cap = static_cast<SecretMonkey::GorillaCaption*>(caption);
+ cap->mLayer->destroyCaption(cap->mCaption);
+ delete cap;
+}
+
+size_t GorillaBackend::getPrimitiveBytes(const RenderRectangle*) const
+{
+ return sizeof(SecretMonkey::GorillaRectangle) + sizeof(Gorilla::Rectangle);
+}
+
+size_t GorillaBackend::getPrimitiveBytes(const RenderCaption* caption) const
+{
+ const SecretMonkey::GorillaCaption* cap = static_cast<const SecretMonkey::GorillaCaption*>(caption);
+ return sizeof(SecretMonkey::GorillaCaption) + sizeof(Gorilla::Caption) + SecretMonkey::stringBytes(cap->mCaption->text());
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+namespace SecretMonkey
+{
+
+// Input logs start with this, then a version byte. Each event is its type byte, the microseconds since
+// the previous event, then for mouse events the position, wheel and buttons (and the button pressed or
+// released) and for key presses the character. Numbers are LEB128 varints, signed ones zigzag encoded.
+static const char InputLogMagic[4] = { 'M', 'K', 'I', 'N' };
+static const char InputLogVersion = 1;
+
+void writeVarint(std::ostream& out, Ogre::uint64 value)
+{
+ while (value >= 0x80)
  {
-  if (S::matches_insensitive(working, "none"))
-   background.type = Background::BT_Transparent;
-  else if (S::matches_insensitive(working, "transparent"))
-   background.type = Background::BT_Transparent;
-  background.set = true;
+  out.put(char((value & 0x7F) | 0x80));
+  value >>= 7;
  }
- else if (key == "background-image")
+ out.put(char(value));
+}
+
+void writeSignedVarint(std::ostream& out, int value)
+{
+ writeVarint(out, (Ogre::uint32(value) << 1) ^ Ogre::uint32(value >> 31));
+}
+
+bool readVarint(std::istream& in, Ogre::uint64& value)
+{
+ value = 0;
+ for (unsigned int shift=0;shift < 64;shift += 7)
  {
-  background.type = Background::BT_Sprite;
-  background.sprite = working;
-  background.set = true;
+  int c = in.get();
+  if (c == EOF)
+   return false;
+  value |= Ogre::uint64(c & 0x7F) << shift;
+  if ((c & 0x80) == 0)
+   return true;
  }
- else if (key == "background-colour" || key == "background-color")
- {
-  background.type = Background::BT_Colour;
-  if (S::starts_insensitive(working, "rgb"))
+ return false;
+}
+
+bool readSignedVarint(std::istream& in, int& value)
+{
+ Ogre::uint64 v = 0;
+ if (readVarint(in, v) == false)
+  return false;
+ Ogre::uint32 u = Ogre::uint32(v);
+ value = int(u >> 1) ^ -int(u & 1);
+ return true;
+}
+
+bool isMouseEvent(int type)
+{
+ return type == InputEvent_MouseMoved || type == InputEvent_MousePressed || type == InputEvent_MouseReleased;
+}
+
+Ogre::uint64 inputClock()
+{
+ return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Forwards to the tree's own callback after noting each call.
+class ReplayCallback : public Callback
+{
+ public:
+  
+  ReplayCallback(Callback* forward, std::vector<InputReplay::CallbackRecord>& records)
+  : mForward(forward), mRecords(records), mEvent(0)
   {
-   background.colour = S::getCSSRGBAColour(working);
-  background.set = true;
   }
- }
- else if (key == "colour" || key == "color")
- {
-  if (S::starts_insensitive(working, "rgb"))
+  
+  void onElementActivated(Element* elem, const OIS::MouseState& state)
   {
-   colour = S::getCSSRGBAColour(working);
-   colour_set = true;
+   _note(InputReplay::Callback_Activated, elem);
+   if (mForward)
+    mForward->onElementActivated(elem, state);
   }
- }
+  
+  void onElementFocused(Element* elem, const OIS::MouseState& state)
+  {
+   _note(InputReplay::Callback_Focused, elem);
+   if (mForward)
+    mForward->onElementFocused(elem, state);
+  }
+  
+  void onElementBlur(Element* elem, const OIS::MouseState& state)
+  {
+   _note(InputReplay::Callback_Blur, elem);
+   if (mForward)
+    mForward->onElementBlur(elem, state);
+  }
+  
+  void onTextboxChanged(Element* elem)
+  {
+   _note(InputReplay::Callback_TextboxChanged, elem);
+   if (mForward)
+    mForward->onTextboxChanged(elem);
+  }
+  
+  void _note(InputReplay::CallbackType type, Element* elem)
+  {
+   InputReplay::CallbackRecord record;
+   record.type = type;
+   record.event = mEvent;
+   record.id = elem->getID();
+   record.element_type = elem->getType();
+   mRecords.push_back(record);
+  }
+  
+  Callback*                                  mForward;
+  std::vector<InputReplay::CallbackRecord>&  mRecords;
+  size_t                                     mEvent;
+};
+
+} // namespace SecretMonkey
+
+InputRecorder::InputRecorder(const Ogre::String& path)
+: mFile(path.c_str(), std::ios::out | std::ios::binary),
+  mStart(SecretMonkey::inputClock()),
+  mLast(0),
+  mEvents(0)
+{
+ mFile.write(SecretMonkey::InputLogMagic, 4);
+ mFile.put(SecretMonkey::InputLogVersion);
 }
 
-void ElementStyle::merge(ElementStyle* other, bool isParent)
+void InputRecorder::_recordMouse(InputEventType type, const OIS::MouseState& state, int button)
+{
+ InputEvent evt;
+ evt.type = type;
+ evt.time = SecretMonkey::inputClock() - mStart;
+ evt.x = state.X.abs;
+ evt.y = state.Y.abs;
+ evt.z = state.Z.rel;
+ evt.buttons = state.buttons;
+ evt.button = button;
+ evt.character = 0;
+ _write(evt);
+}
+
+void InputRecorder::_recordKey(InputEventType type, char character)
+{
+ InputEvent evt;
+ evt.type = type;
+ evt.time = SecretMonkey::inputClock() - mStart;
+ evt.x = evt.y = evt.z = evt.buttons = 0;
+ evt.button = -1;
+ evt.character = character;
+ _write(evt);
+}
+
+void InputRecorder::_write(const InputEvent& evt)
 {
  
- if (!isParent)
- {
-    if (left_set)
-    {
-     other->left = left;
-     other->left_unit = left_unit;
-     other->left_set = true;
-    }
- 
-    if (top_set)
-    {
-     other->top = top;
-     other->top_unit = top_unit;
-     other->top_set = true;
-    }
- 
-    if (width_set)
-    {
-     other->width = width;
-     other->width_unit = width_unit;
-     other->width_set = true;
-    }
+ namespace S = ::Monkey::SecretMonkey;
  
-    if (height_set)
-    {
-     other->height = height;
-     other->height_unit = height_unit;
-     other->height_set = true;
-    }
- }
+ mFile.put(char(evt.type));
+ S::writeVarint(mFile, evt.time - mLast);
+ mLast = evt.time;
  
- if (alignment.horz_set)
+ if (S::isMouseEvent(evt.type))
  {
-  other->alignment.horz = alignment.horz;
-  other->alignment.horz_set = true;
+  S::writeSignedVarint(mFile, evt.x);
+  S::writeSignedVarint(mFile, evt.y);
+  S::writeSignedVarint(mFile, evt.z);
+  S::writeVarint(mFile, Ogre::uint32(evt.buttons));
+  if (evt.type != InputEvent_MouseMoved)
+   mFile.put(char(evt.button));
  }
+ else if (evt.type == InputEvent_KeyPress)
+  mFile.put(evt.character);
  
- if (alignment.vert_set)
+ mEvents++;
+}
+
+InputReplay::InputReplay(const Ogre::String& path)
+: mValid(false),
+  mTotalTime(0)
+{
+ 
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+ char magic[4] = { 0, 0, 0, 0 };
+ file.read(magic, 4);
+ if (file.good() == false || memcmp(magic, S::InputLogMagic, 4) != 0 || file.get() != S::InputLogVersion)
  {
-  other->alignment.vert = alignment.vert;
-  other->alignment.vert_set = true;
+  Ogre::LogManager::getSingleton().logMessage("Monkey: Input log '" + path + "' is not a Monkey input log");
+  return;
  }
  
- if (!isParent)
+ Ogre::uint64 time = 0;
+ for (int type = file.get();type != EOF;type = file.get())
  {
-   
-   if (background.set)
-   {
-    other->background.type = background.type;
-    other->background.colour = background.colour;
-    other->background.sprite = background.sprite;
-    other->background.set = true;
-   }
-   
-   if (border.width_set)
-   {
-    other->border.width = border.width;
-    other->border.width_set = true;
-   }
+  InputEvent evt;
+  evt.type = InputEventType(type);
+  evt.x = evt.y = evt.z = evt.buttons = 0;
+  evt.button = -1;
+  evt.character = 0;
   
-   if (border.left_set)
+  Ogre::uint64 delta = 0, buttons = 0;
+  bool ok = S::readVarint(file, delta);
+  time += delta;
+  evt.time = time;
+  
+  if (S::isMouseEvent(type))
+  {
+   ok = ok && S::readSignedVarint(file, evt.x) && S::readSignedVarint(file, evt.y) && S::readSignedVarint(file, evt.z) && S::readVarint(file, buttons);
+   evt.buttons = int(buttons);
+   if (ok && type != InputEvent_MouseMoved)
    {
-    other->border.left = border.left;
-    other->border.left_set = true;
+    int button = file.get();
+    ok = button != EOF;
+    evt.button = button;
    }
+  }
+  else if (type == InputEvent_KeyPress)
+  {
+   int character = file.get();
+   ok = ok && character != EOF;
+   evt.character = char(character);
+  }
+  else if (type > InputEvent_KeyCancel)
+   ok = false;
+  
+  if (ok == false)
+  {
+   Ogre::LogManager::getSingleton().logMessage("Monkey: Input log '" + path + "' is truncated or corrupt after " + Ogre::StringConverter::toString(mEvents.size()) + " events");
+   break;
+  }
+  
+  mEvents.push_back(evt);
+ }
  
-   if (border.top_set)
-   {
-    other->border.top = border.top;
-    other->border.top_set = true;
-   }
+ mValid = true;
+}
+
+void InputReplay::run(PuzzleTree* tree)
+{
  
-   if (border.right_set)
-   {
-    other->border.right = border.right;
-    other->border.right_set = true;
-   }
+ typedef std::chrono::high_resolution_clock Clock;
  
-   if (border.bottom_set)
-   {
-    other->border.bottom = border.bottom;
-    other->border.bottom_set = true;
-   }
- }
+ mCallbacks.clear();
+ mEventTimes.clear();
+ mEventTimes.reserve(mEvents.size());
+ mTotalTime = 0;
  
- if (colour_set)
- {
-  other->colour = colour;
-  other->colour_set = true;
- }
+ Callback* original = tree->getCallback();
+ SecretMonkey::ReplayCallback callback(original, mCallbacks);
+ tree->setCallback(&callback);
  
- if (font_set)
+ // Replaying must not record itself.
+ InputRecorder* recorder = tree->getInputRecorder();
+ tree->setInputRecorder(0);
+ 
+ OIS::MouseState state;
+ state.width = int(tree->getBackend()->getWidth());
+ state.height = int(tree->getBackend()->getHeight());
+ OIS::MouseEvent arg(0, state);
+ 
+ for (size_t i=0;i < mEvents.size();i++)
  {
-  other->font = font;
-  other->font_set = true;
+  const InputEvent& evt = mEvents[i];
+  callback.mEvent = i;
+  state.X.abs = evt.x;
+  state.Y.abs = evt.y;
+  state.Z.rel = evt.z;
+  state.buttons = evt.buttons;
+  
+  Clock::time_point start = Clock::now();
+  
+  switch(evt.type)
+  {
+   case InputEvent_MouseMoved:    tree->mouseMoved(arg); break;
+   case InputEvent_MousePressed:  tree->mousePressed(arg, OIS::MouseButtonID(evt.button)); break;
+   case InputEvent_MouseReleased: tree->mouseReleased(arg, OIS::MouseButtonID(evt.button)); break;
+   case InputEvent_KeyPress:      tree->onKeyPress(evt.character); break;
+   case InputEvent_KeyBackspace:  tree->onKeyBackspace(); break;
+   case InputEvent_KeySubmit:     tree->onKeySubmit(); break;
+   case InputEvent_KeyCancel:     tree->onKeyCancel(); break;
+  }
+  
+  double time = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+  mEventTimes.push_back(time);
+  mTotalTime += time;
  }
  
+ tree->setInputRecorder(recorder);
+ tree->setCallback(original);
 }
 
-
 // ----------------------------------------------------------------------------------------------------------------
 
+RecordingBackend::RecordingBackend(float width, float height)
+: mWidth(width),
+  mHeight(height)
+{
+ resetCounters();
+}
 
-Element::Element(const std::string& id_and_or_classes, Gorilla::Layer* layer, PuzzleTree* tree, Element* parent, size_t index, int type, const ElementArgs& args)
-: mTree(tree),
-  mParent(parent),
-  mLayer(layer),
-  mRectangle(0),
-  mCaption(0),
-  mIndex(index),
-  mState(ElementState_Normal),
-  mType(type),
-  mIsVisible(true)
+RecordingBackend::~RecordingBackend()
 {
- 
- namespace S = ::Monkey::SecretMonkey;
- 
- mLookNormal.reset();
- std::string str_type = mTree->getElementType(mType);
- // Merge styles from known type.
- if (mType != -1)
+ for (size_t i=0;i < 16;i++)
  {
-  merge_style(str_type, &mLookNormal, false);
+  for (std::list<Rectangle*>::iterator it = mRectangles[i].begin(); it != mRectangles[i].end(); it++)
+   delete (*it);
+  for (std::list<Caption*>::iterator it = mCaptions[i].begin(); it != mCaptions[i].end(); it++)
+   delete (*it);
  }
+ 
+ for (std::map<Ogre::String, Gorilla::Sprite*>::iterator it = mSprites.begin(); it != mSprites.end(); it++)
+  delete (*it).second;
+ 
+ for (std::map<size_t, Gorilla::GlyphData*>::iterator it = mGlyphData.begin(); it != mGlyphData.end(); it++)
+  delete (*it).second;
+}
 
- // Auto subscribe events if buttons, textboxes or OSK elements.
- if (mType == ElementType_Button || mType == ElementType_TextBox || mType == ElementType_OSKSubmit || mType == ElementType_OSKCancel)
- {
-  listen();
- }
- else if (S::args_has(args, "listen"))
- {
-  if ( Ogre::StringConverter::parseBool(S::args_get(args, "listen", "false")) )
-  {
-   listen();
-  }
- }
+size_t RecordingBackend::getPrimitiveBytes(const RenderRectangle*) const
+{
+ // The primitive and its std::list node.
+ return sizeof(Rectangle) + 3 * sizeof(void*);
+}
+
+size_t RecordingBackend::getPrimitiveBytes(const RenderCaption* caption) const
+{
+ return sizeof(Caption) + 3 * sizeof(void*) + SecretMonkey::stringBytes(static_cast<const Caption*>(caption)->string);
+}
+
+void RecordingBackend::resetCounters()
+{
+ mCounters.rectangles_created = 0;
+ mCounters.rectangles_destroyed = 0;
+ mCounters.captions_created = 0;
+ mCounters.captions_destroyed = 0;
+ mCounters.setter_calls = 0;
+}
+
+void RecordingBackend::loadAtlas(const Ogre::String& atlas)
+{
+ mAtlas = atlas;
+}
+
+Gorilla::Sprite* RecordingBackend::getSprite(const Ogre::String& name)
+{
+ std::map<Ogre::String, Gorilla::Sprite*>::iterator it = mSprites.find(name);
+ if (it != mSprites.end())
+  return (*it).second;
+ Gorilla::Sprite* sprite = new Gorilla::Sprite();
+ mSprites[name] = sprite;
+ return sprite;
+}
+
+Gorilla::GlyphData* RecordingBackend::getGlyphData(size_t font)
+{
+ std::map<size_t, Gorilla::GlyphData*>::iterator it = mGlyphData.find(font);
+ if (it != mGlyphData.end())
+  return (*it).second;
+ Gorilla::GlyphData* glyphData = new Gorilla::GlyphData();
+ mGlyphData[font] = glyphData;
+ return glyphData;
+}
+
+RenderRectangle* RecordingBackend::createRectangle(size_t layer, float left, float top, float width, float height)
+{
+ Rectangle* rect = new Rectangle();
+ rect->layer = layer;
+ rect->left = left;
+ rect->top = top;
+ rect->width = width;
+ rect->height = height;
+ rect->background = Ogre::ColourValue::White;
+ rect->sprite = 0;
+ rect->has_background = true;
+ rect->border_width = 0;
+ rect->counters = &mCounters;
+ rect->it = mRectangles[layer].insert(mRectangles[layer].end(), rect);
+ mCounters.rectangles_created++;
+ return rect;
+}
+
+void RecordingBackend::destroyRectangle(RenderRectangle* rectangle)
+{
+ Rectangle* rect = static_cast<Rectangle*>(rectangle);
+ mRectangles[rect->layer].erase(rect->it);
+ delete rect;
+ mCounters.rectangles_destroyed++;
+}
+
+RenderCaption* RecordingBackend::createCaption(size_t layer, size_t font, float left, float top, const Ogre::String& text)
+{
+ Caption* cap = new Caption();
+ cap->layer = layer;
+ cap->left = left;
+ cap->top = top;
+ cap->width = 0;
+ cap->height = 0;
+ cap->glyphs = font;
+ cap->foreground = Ogre::ColourValue::White;
+ cap->horz = Gorilla::TextAlign_Left;
+ cap->vert = Gorilla::VerticalAlign_Top;
+ cap->string = text;
+ cap->counters = &mCounters;
+ cap->it = mCaptions[layer].insert(mCaptions[layer].end(), cap);
+ mCounters.captions_created++;
+ return cap;
+}
+
+void RecordingBackend::destroyCaption(RenderCaption* caption)
+{
+ Caption* cap = static_cast<Caption*>(caption);
+ mCaptions[cap->layer].erase(cap->it);
+ delete cap;
+ mCounters.captions_destroyed++;
+}
+
+void RecordingBackend::Rectangle::position(float l, float t)
+{
+ left = l;
+ top = t;
+ counters->setter_calls++;
+}
+
+void RecordingBackend::Rectangle::size(float w, float h)
+{
+ width = w;
+ height = h;
+ counters->setter_calls++;
+}
+
+void RecordingBackend::Rectangle::background_colour(const Ogre::ColourValue& col)
+{
+ background = col;
+ sprite = 0;
+ has_background = true;
+ counters->setter_calls++;
+}
+
+void RecordingBackend::Rectangle::background_image(Gorilla::Sprite* spr)
+{
+ background = Ogre::ColourValue::White;
+ sprite = spr;
+ has_background = (spr != 0);
+ counters->setter_calls++;
+}
+
+void RecordingBackend::Rectangle::no_background()
+{
+ sprite = 0;
+ has_background = false;
+ counters->setter_calls++;
+}
+
+void RecordingBackend::Rectangle::border(float w, const Ogre::ColourValue& t, const Ogre::ColourValue& r, const Ogre::ColourValue& b, const Ogre::ColourValue& l)
+{
+ border_width = w;
+ border_top = t;
+ border_right = r;
+ border_bottom = b;
+ border_left = l;
+ counters->setter_calls++;
+}
+
+void RecordingBackend::Rectangle::no_border()
+{
+ border_width = 0;
+ counters->setter_calls++;
+}
+
+void RecordingBackend::Caption::position(float l, float t)
+{
+ left = l;
+ top = t;
+ counters->setter_calls++;
+}
+
+void RecordingBackend::Caption::size(float w, float h)
+{
+ width = w;
+ height = h;
+ counters->setter_calls++;
+}
+
+void RecordingBackend::Caption::font(size_t f)
+{
+ glyphs = f;
+ counters->setter_calls++;
+}
+
+void RecordingBackend::Caption::colour(const Ogre::ColourValue& col)
+{
+ foreground = col;
+ counters->setter_calls++;
+}
+
+void RecordingBackend::Caption::align(Gorilla::TextAlignment h, Gorilla::VerticalAlignment v)
+{
+ horz = h;
+ vert = v;
+ counters->setter_calls++;
+}
+
+void RecordingBackend::Caption::text(const Ogre::String& t)
+{
+ string = t;
+ counters->setter_calls++;
+}
+
+// ----------------------------------------------------------------------------------------------------------------
+
+namespace SecretMonkey
+{
+
+inline Ogre::uint32 packRGBA(const Ogre::ColourValue& col, float alpha = 1.0f)
+{
+ return  Ogre::uint32(std::min(std::max(col.r, 0.0f), 1.0f) * 255.0f) |
+        (Ogre::uint32(std::min(std::max(col.g, 0.0f), 1.0f) * 255.0f) << 8) |
+        (Ogre::uint32(std::min(std::max(col.b, 0.0f), 1.0f) * 255.0f) << 16) |
+        (Ogre::uint32(std::min(std::max(col.a * alpha, 0.0f), 1.0f) * 255.0f) << 24);
+}
 
+// (x * y) / 255, rounded, for 0..255 inputs.
+inline Ogre::uint32 mul255(Ogre::uint32 x, Ogre::uint32 y)
+{
+ Ogre::uint32 t = x * y + 128;
+ return (t + (t >> 8)) >> 8;
+}
 
- // Make this element a singleton if a OSK element.
- if (mType > ElementType_OSK_BEGIN && mType < ElementType_OSK_END)
- {
-  mTree->mSingletonElements[mType] = this;
- }
- 
- // Title.
- if (S::args_has(args, "title"))
- {
-  mTitle = S::args_get(args, "title");
- }
- 
- refreshLook(&mLookNormal, S::maml_id_css_expand(id_and_or_classes));
- 
- // Inline CSS.
- if (S::args_has(args, "style"))
+// Blend a source colour over an opaque destination pixel with the given coverage.
+inline Ogre::uint32 blendRGBA(Ogre::uint32 dst, Ogre::uint32 src, Ogre::uint32 alpha)
+{
+ Ogre::uint32 inv = 255 - alpha;
+ Ogre::uint32 r = mul255(src & 0xFF, alpha) + mul255(dst & 0xFF, inv);
+ Ogre::uint32 g = mul255((src >> 8) & 0xFF, alpha) + mul255((dst >> 8) & 0xFF, inv);
+ Ogre::uint32 b = mul255((src >> 16) & 0xFF, alpha) + mul255((dst >> 16) & 0xFF, inv);
+ return r | (g << 8) | (b << 16) | 0xFF000000;
+}
+
+// Fill a run of pixels. Opaque runs are a plain store and translucent runs one blend per pixel;
+// both loops are simple enough for the compiler to vectorise.
+inline void fillSpan(Ogre::uint32* dst, size_t count, Ogre::uint32 colour)
+{
+ Ogre::uint32 alpha = colour >> 24;
+ if (alpha == 0)
+  return;
+ if (alpha == 255)
  {
-  Ogre::vector<Ogre::String>::type  workings = Ogre::StringUtil::split(S::args_get(args, "style"), ";");
-  bool didCut = false;
-  S::StringPair sp;
-  for (size_t i=0;i < workings.size();i++)
-  {
-   S::trim(workings[i]);
-   if (workings[i].length() == 0)
-    continue;
-   
-   sp = S::cut(workings[i], didCut, ':', 0);
-   if (didCut)
-   {
-    S::lower(sp.first);
-    mLookNormal.from_css(sp.first, sp.second);
-   }
-  }
+  std::fill(dst, dst + count, colour);
+  return;
  }
- 
- mLookActive.reset();
- mLookNormal.merge(&mLookActive, false);
- mLookHover.reset();
- mLookNormal.merge(&mLookHover, false);
- 
- merge_style(str_type + ":hover", &mLookHover, false);
- if (mID.length())
-  merge_style("#" + mID + ":hover", &mLookHover, false);
- 
- merge_style(str_type + ":active", &mLookActive, false);
- if (mID.length())
-  merge_style("#" + mID + ":active", &mLookActive, false);
- 
- reapplyLook();
- 
+ for (size_t i=0;i < count;i++)
+  dst[i] = blendRGBA(dst[i], colour, alpha);
 }
 
-Element::~Element()
+} // namespace SecretMonkey
+
+SoftwareBackend::SoftwareBackend(size_t width, size_t height)
+: RecordingBackend(float(width), float(height)),
+  mPixelWidth(width),
+  mPixelHeight(height),
+  mTextureWidth(0),
+  mTextureHeight(0)
 {
- // TODO
+ mPixels.resize(mPixelWidth * mPixelHeight);
+ setClearColour(Ogre::ColourValue::Black);
 }
 
-void Element::merge_style(const std::string& name, ElementStyle* style, bool isParent)
+void SoftwareBackend::setClearColour(const Ogre::ColourValue& colour)
 {
- if (style == 0)
-  return;
- if (name.length() == 0)
-  return;
- ElementStyle* a = 0;
- a = mTree->getStyle(name);
- if (a)
-  a->merge(style, isParent);
+ mClearColour = SecretMonkey::packRGBA(colour) | 0xFF000000;
 }
 
-void Element::refreshLook(ElementStyle* look, const Ogre::String& id_and_or_classes)
+void SoftwareBackend::loadAtlas(const Ogre::String& atlas)
 {
  
  namespace S = ::Monkey::SecretMonkey;
  
- std::string classes;
- classes.append(id_and_or_classes);
+ RecordingBackend::loadAtlas(atlas);
  
- // Allow for a child's style based on parent-child order...thing.
- if (mParent != 0)
- {
-  mParent->getNormalStyle()->merge(look, true);
-  classes.append(" #" + mParent->getID() + ":child");   // '#parent:child'
- }
+ Ogre::DataStreamPtr stream = Ogre::ResourceGroupManager::getSingleton().openResource(atlas + ".gorilla", Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME);
  
- Ogre::vector<Ogre::String>::type strs = Ogre::StringUtil::split(classes, " ");
- Ogre::String name;
+ Ogre::String line, section, textureName;
+ Font* font = 0;
+ std::vector<std::pair<Ogre::String, Ogre::vector<Ogre::String>::type> > sprites;
  
- for (size_t i=0;i < strs.size();i++)
+ while (!stream->eof())
  {
-  
-  if (strs[i].length() == 0)
+  line = stream->getLine();
+  S::trim(line);
+  if (line.length() == 0 || S::starts(line, "#"))
    continue;
   
-  if (strs[i][0] == '#' && S::has(strs[i], ':') == false)
-   mID = S::slice_copy(strs[i], 1);
-    
-  ElementStyle* style = 0;
-  
-  style = mTree->getStyle(strs[i]);
-  
-  if (style == 0)
+  if (line[0] == '[')
+  {
+   section = line;
+   font = 0;
+   if (S::starts_insensitive(section, "[Font."))
+   {
+    S::slice_after_first_of(section, '.');
+    S::slice_to_first_of(section, ']');
+    font = &mFonts[Ogre::StringConverter::parseUnsignedInt(section)];
+    font->line_height = 0;
+    font->space_length = 0;
+    font->kerning = 0;
+    font->range_begin = 33;
+    font->range_end = 126;
+    section = "[Font]";
+   }
    continue;
+  }
   
-  style->merge(look, false);
+  Ogre::vector<Ogre::String>::type strs = Ogre::StringUtil::split(line, " \t");
+  if (strs.size() < 2)
+   continue;
   
+  if (section == "[Texture]" && strs[0] == "file")
+  {
+   textureName = strs[1];
+  }
+  else if (section == "[Sprites]" && strs.size() >= 5)
+  {
+   sprites.push_back(std::pair<Ogre::String, Ogre::vector<Ogre::String>::type>(strs[0], strs));
+  }
+  else if (font != 0)
+  {
+   if (strs[0] == "lineheight")
+    font->line_height = Ogre::StringConverter::parseReal(strs[1]);
+   else if (strs[0] == "spacelength")
+    font->space_length = Ogre::StringConverter::parseReal(strs[1]);
+   else if (strs[0] == "kerning")
+    font->kerning = Ogre::StringConverter::parseReal(strs[1]);
+   else if (strs[0] == "range" && strs.size() >= 3)
+   {
+    font->range_begin = Ogre::StringConverter::parseUnsignedInt(strs[1]);
+    font->range_end = Ogre::StringConverter::parseUnsignedInt(strs[2]);
+   }
+   else if (S::starts(strs[0], "glyph_") && strs.size() >= 5)
+   {
+    Ogre::uint code = Ogre::StringConverter::parseUnsignedInt(strs[0].substr(6));
+    if (code >= font->glyphs.size())
+    {
+     Glyph unset = { 0, 0, 0, 0, 0, false };
+     font->glyphs.resize(code + 1, unset);
+    }
+    Glyph& glyph = font->glyphs[code];
+    glyph.left = Ogre::StringConverter::parseInt(strs[1]);
+    glyph.top = Ogre::StringConverter::parseInt(strs[2]);
+    glyph.width = Ogre::StringConverter::parseInt(strs[3]);
+    glyph.height = Ogre::StringConverter::parseInt(strs[4]);
+    glyph.advance = strs.size() >= 6 ? Ogre::StringConverter::parseReal(strs[5]) : float(glyph.width);
+    glyph.set = true;
+   }
+  }
+ }
+ 
+ // Texture, kept as packed RGBA like the frame buffer.
+ Ogre::Image image;
+ image.load(textureName, Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME);
+ mTextureWidth = image.getWidth();
+ mTextureHeight = image.getHeight();
+ mTexture.resize(mTextureWidth * mTextureHeight);
+ for (size_t y=0;y < mTextureHeight;y++)
+  for (size_t x=0;x < mTextureWidth;x++)
+   mTexture[y * mTextureWidth + x] = S::packRGBA(image.getColourAt(x, y, 0));
+ 
+ // Sprites are described by the same texture coordinates Gorilla uses.
+ for (size_t i=0;i < sprites.size();i++)
+ {
+  Gorilla::Sprite* sprite = RecordingBackend::getSprite(sprites[i].first);
+  float left = Ogre::StringConverter::parseReal(sprites[i].second[1]),
+        top = Ogre::StringConverter::parseReal(sprites[i].second[2]),
+        width = Ogre::StringConverter::parseReal(sprites[i].second[3]),
+        height = Ogre::StringConverter::parseReal(sprites[i].second[4]);
+  sprite->uvLeft = left / float(mTextureWidth);
+  sprite->uvTop = top / float(mTextureHeight);
+  sprite->uvRight = (left + width) / float(mTextureWidth);
+  sprite->uvBottom = (top + height) / float(mTextureHeight);
+  sprite->spriteWidth = width;
+  sprite->spriteHeight = height;
  }
  
 }
 
-void Element::debug(size_t index)
+Gorilla::Sprite* SoftwareBackend::getSprite(const Ogre::String& name)
 {
- for (size_t i=0;i < index;i++)
-  std::cout << " ";
-  
- std::cout << "+ " << mID << "," << mIndex << "," << mTree->getElementType(mType) << ")\n";
- for (std::multimap<Ogre::String, Element*>::iterator it = mChildren.begin(); it != mChildren.end(); it++)
-  (*it).second->debug(index + 1);
+ std::map<Ogre::String, Gorilla::Sprite*>::iterator it = mSprites.find(name);
+ if (it == mSprites.end())
+  return 0;
+ return (*it).second;
 }
 
-Element* Element::intersectionTest(int left, int top)
+Gorilla::GlyphData* SoftwareBackend::getGlyphData(size_t font)
 {
- if (mRectangle == 0)
+ if (mFonts.find(font) == mFonts.end())
   return 0;
+ return RecordingBackend::getGlyphData(font);
+}
+
+void SoftwareBackend::render()
+{
  
- bool intersects = mRectangle->intersects(Ogre::Vector2(left, top));
- if (intersects == false)
-  return 0;
+ std::fill(mPixels.begin(), mPixels.end(), mClearColour);
  
- Element* childRet = 0;
- for (std::multimap<Ogre::String, Element*>::iterator it = mChildren.begin(); it != mChildren.end(); it++)
+ for (size_t i=0;i < 16;i++)
  {
-  childRet = (*it).second->intersectionTest(left, top);
-  if (childRet != 0)
-   return childRet;
+  for (std::list<Rectangle*>::const_iterator it = mRectangles[i].begin(); it != mRectangles[i].end(); it++)
+   _drawRectangle(*it);
+  for (std::list<Caption*>::const_iterator it = mCaptions[i].begin(); it != mCaptions[i].end(); it++)
+   _drawCaption(*it);
  }
  
- return this;
 }
 
-Element* Element::createChild(const std::string& id_and_or_classes, int type, const ElementArgs& args)
+void SoftwareBackend::_fill(int left, int top, int right, int bottom, Ogre::uint32 colour)
 {
- size_t index = mIndex + 1;
- if (index >= 14)
-  index = 14;
- Element* elem = new Element(id_and_or_classes, mTree->mLayers[index], mTree, this, index, type, args);
- mTree->mElements.insert(std::pair<Ogre::String, Element*>(elem->getID(), elem));
- mChildren.insert(std::pair<Ogre::String, Element*>(elem->getID(), elem));
- return elem;
+ left = std::max(left, 0);
+ top = std::max(top, 0);
+ right = std::min(right, int(mPixelWidth));
+ bottom = std::min(bottom, int(mPixelHeight));
+ if (left >= right || top >= bottom)
+  return;
+ for (int y=top;y < bottom;y++)
+  SecretMonkey::fillSpan(&mPixels[y * mPixelWidth + left], right - left, colour);
 }
 
-void Element::reapplyLook()
+void SoftwareBackend::_blit(int left, int top, int width, int height, int u, int v, int uw, int vh, Ogre::uint32 tint, const ClipRect& clip)
 {
  
- if (mIsVisible == false)
- {
-  if (mRectangle)
-  {
-   mLayer->destroyRectangle(mRectangle);
-   mRectangle = 0;
-  }
-  if (mCaption)
-  {
-   mLayer->destroyCaption(mCaption);
-   mCaption = 0;
-  }
+ namespace S = ::Monkey::SecretMonkey;
+ 
+ if (width <= 0 || height <= 0 || uw <= 0 || vh <= 0 || mTexture.empty())
   return;
- }
-
- float left = 0, top = 0, width = 0, height = 0, parentWidth = 0, parentHeight = 0, parentLeft = 0, parentTop = 0;
  
- ElementStyle* style = 0;
- if (mState == ElementState_Normal)
-  style = &mLookNormal;
- else if (mState == ElementState_Hover)
-  style = &mLookHover;
- else
-  style = &mLookActive;
+ int x0 = std::max(left, std::max(int(clip.left), 0)),
+     y0 = std::max(top, std::max(int(clip.top), 0)),
+     x1 = std::min(left + width, std::min(int(clip.right), int(mPixelWidth))),
+     y1 = std::min(top + height, std::min(int(clip.bottom), int(mPixelHeight)));
  
- if (mParent)
- {
-  parentWidth = mParent->getScreenWidth();
-  parentHeight = mParent->getScreenHeight();
-  parentLeft = mParent->getScreenLeft();
-  parentTop = mParent->getScreenTop();
- }
- else
+ if (x0 >= x1 || y0 >= y1)
+  return;
+ 
+ // Nearest texel, stepped in 16.16 fixed point.
+ Ogre::uint32 stepU = (Ogre::uint32(uw) << 16) / Ogre::uint32(width),
+              stepV = (Ogre::uint32(vh) << 16) / Ogre::uint32(height);
+ Ogre::uint32 tintAlpha = tint >> 24;
+ bool white = (tint & 0xFFFFFF) == 0xFFFFFF;
+ 
+ for (int y=y0;y < y1;y++)
  {
-  Gorilla::Screen* parentScreen = mTree->getScreen();
-  parentWidth = parentScreen->getWidth();
-  parentHeight = parentScreen->getHeight();
-  parentLeft = 0;
-  parentTop = 0;
+  size_t texelY = std::min(size_t(v) + ((Ogre::uint32(y - top) * stepV) >> 16), mTextureHeight - 1);
+  const Ogre::uint32* texels = &mTexture[texelY * mTextureWidth];
+  Ogre::uint32* dst = &mPixels[y * mPixelWidth];
+  Ogre::uint32 fu = Ogre::uint32(x0 - left) * stepU;
+  for (int x=x0;x < x1;x++, fu += stepU)
+  {
+   Ogre::uint32 texel = texels[std::min(size_t(u) + (fu >> 16), mTextureWidth - 1)];
+   Ogre::uint32 alpha = S::mul255(texel >> 24, tintAlpha);
+   if (alpha == 0)
+    continue;
+   if (white == false)
+    texel = S::mul255(texel & 0xFF, tint & 0xFF) | (S::mul255((texel >> 8) & 0xFF, (tint >> 8) & 0xFF) << 8) | (S::mul255((texel >> 16) & 0xFF, (tint >> 16) & 0xFF) << 16);
+   dst[x] = S::blendRGBA(dst[x], texel, alpha);
+  }
  }
  
- if (style->left_unit == Unit_Pixel)
-  left = style->left;
- else if (style->left_unit == Unit_Percent)
-  left = style->left * parentWidth;
- else if (style->left_unit == Unit_AlignRight)
-  left = parentWidth;
+}
+
+void SoftwareBackend::_drawRectangle(const Rectangle* rect)
+{
  
- if (style->width_unit == Unit_Pixel)
-  width = style->width;
- else
-  width = style->width * parentWidth;
+ namespace S = ::Monkey::SecretMonkey;
  
- if (style->top_unit == Unit_Pixel)
-  top = style->top;
- else if (style->top_unit == Unit_Percent)
-  top = style->top * parentHeight;
- else if (style->top_unit == Unit_AlignRight)
-  top = parentHeight;
+ int left = int(rect->left), top = int(rect->top),
+     right = int(rect->left + rect->width), bottom = int(rect->top + rect->height);
  
-
- if (left + width > parentWidth)
+ if (rect->has_background)
  {
-  if (style->left_unit == Unit_AlignRight)
-   left -= (left + width) - parentWidth;
+  if (rect->sprite)
+  {
+   ClipRect screen = { 0, 0, float(mPixelWidth), float(mPixelHeight) };
+   _blit(left, top, right - left, bottom - top,
+         int(rect->sprite->uvLeft * mTextureWidth), int(rect->sprite->uvTop * mTextureHeight),
+         int(rect->sprite->spriteWidth), int(rect->sprite->spriteHeight), 0xFFFFFFFF, screen);
+  }
   else
-   width -= (left + width) - parentWidth;
+  {
+   _fill(left, top, right, bottom, S::packRGBA(rect->background));
+  }
  }
-
- if (style->top_unit == Unit_Pixel)
-  top = style->top;
- else if (style->top_unit == Unit_Percent)
-  top = style->top * parentHeight;
- else if (style->top_unit == Unit_AlignRight)
-  top = parentHeight;
  
- if (style->height_unit == Unit_Pixel)
-  height = style->height;
- else
-  height = style->height * parentHeight;
- 
- if (top + height > parentHeight)
+ // Gorilla draws borders around the outside of the rectangle.
+ int b = int(rect->border_width);
+ if (b > 0)
  {
-  if (style->top_unit == Unit_AlignRight)
-   top -= (top + height) - parentHeight;
-  else
-   height -= (top + height) - parentHeight;
+  _fill(left - b, top - b, right + b, top, S::packRGBA(rect->border_top));
+  _fill(right, top, right + b, bottom, S::packRGBA(rect->border_right));
+  _fill(left - b, bottom, right + b, bottom + b, S::packRGBA(rect->border_bottom));
+  _fill(left - b, top, left, bottom, S::packRGBA(rect->border_left));
  }
+ 
+}
 
- if (style->left_unit == Unit_AlignCenter)
- {
-  left = (parentWidth * 0.5) - (width * 0.5f);
-  if (left + width > parentWidth)
-   width -= (left + width) - parentWidth;
- }
+void SoftwareBackend::_drawCaption(const Caption* cap)
+{
  
- if (style->top_unit == Unit_AlignCenter)
- {
-  top = (parentHeight * 0.5) - (height * 0.5f);
-  if (top + height > parentHeight)
-   height -= (top + height) - parentHeight;
- }
+ namespace S = ::Monkey::SecretMonkey;
  
- left += parentLeft;
- top += parentTop;
+ std::map<size_t, Font>::const_iterator it = mFonts.find(cap->glyphs);
+ if (it == mFonts.end())
+  return;
+ const Font& font = (*it).second;
  
- if (mText.length() != 0)
+ float textWidth = 0;
+ for (size_t i=0;i < cap->string.length();i++)
  {
-  if (mCaption == 0)
-   mCaption = mLayer->createCaption(style->font, top, top, mText);
-  mCaption->colour(style->colour);
-  mCaption->align(style->alignment.horz);
-  mCaption->vertical_align(style->alignment.vert);
-  mCaption->width(width);
-  mCaption->height(height);
-  mCaption->left(left);
-  mCaption->top(top);
-  mCaption->colour(style->colour);
-  mCaption->no_background();
-  mCaption->font(style->font);
-  mCaption->text(mText);
+  const Glyph* glyph = font.find(Ogre::uchar(cap->string[i]));
+  if (glyph)
+   textWidth += glyph->advance + font.kerning;
+  else
+   textWidth += font.space_length;
  }
  
- if (mText.length() == 0 && mCaption != 0)
- {
-  mLayer->destroyCaption(mCaption);
-  mCaption = 0;
- }
+ float x = cap->left, y = cap->top;
+ if (cap->horz == Gorilla::TextAlign_Centre)
+  x += (cap->width - textWidth) * 0.5f;
+ else if (cap->horz == Gorilla::TextAlign_Right)
+  x += cap->width - textWidth;
  
- if (style->background.type != ElementStyle::Background::BT_Transparent || style->border.width != 0)
+ if (cap->vert == Gorilla::VerticalAlign_Middle)
+  y += (cap->height - font.line_height) * 0.5f;
+ else if (cap->vert == Gorilla::VerticalAlign_Bottom)
+  y += cap->height - font.line_height;
+ 
+ ClipRect clip = { cap->left, cap->top, cap->left + cap->width, cap->top + cap->height };
+ Ogre::uint32 tint = S::packRGBA(cap->foreground);
+ 
+ for (size_t i=0;i < cap->string.length();i++)
  {
-  if (mRectangle == 0)
-   mRectangle = mLayer->createRectangle(top, top, width, height);
-  
-  if (style->background.type == ElementStyle::Background::BT_Colour)
-   mRectangle->background_colour(style->background.colour);
-  else if (style->background.type == ElementStyle::Background::BT_Sprite)
+  const Glyph* glyph = font.find(Ogre::uchar(cap->string[i]));
+  if (glyph == 0)
   {
-   mRectangle->background_image(style->background.sprite);
+   x += font.space_length;
+   continue;
   }
-  else
-   mRectangle->no_background();
-  
-  if (style->border.width == 0)
-   mRectangle->no_border();
-  else
-   mRectangle->border(style->border.width, style->border.top, style->border.right, style->border.bottom, style->border.left);
-  
-  mRectangle->position(left, top);
-  mRectangle->width(width);
-  mRectangle->height(height);
+  _blit(int(x), int(y), glyph->width, glyph->height, glyph->left, glyph->top, glyph->width, glyph->height, tint, clip);
+  x += glyph->advance + font.kerning;
  }
- else
+ 
+}
+
+void SoftwareBackend::writePPM(const Ogre::String& path) const
+{
+ std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+ file << "P6\n" << mPixelWidth << " " << mPixelHeight << "\n255\n";
+ std::vector<char> row(mPixelWidth * 3);
+ for (size_t y=0;y < mPixelHeight;y++)
  {
-  if (mRectangle)
+  const Ogre::uint32* src = &mPixels[y * mPixelWidth];
+  for (size_t x=0;x < mPixelWidth;x++)
   {
-   mLayer->destroyRectangle(mRectangle);
-   mRectangle = 0;
+   row[x * 3 + 0] = char(src[x] & 0xFF);
+   row[x * 3 + 1] = char((src[x] >> 8) & 0xFF);
+   row[x * 3 + 2] = char((src[x] >> 16) & 0xFF);
   }
+  file.write(&row[0], row.size());
  }
-
- for (std::multimap<Ogre::String, Element*>::iterator it = mChildren.begin(); it != mChildren.end(); it++)
-  (*it).second->reapplyLook();
- 
 }
 
+void SoftwareBackend::writePNG(const Ogre::String& path) const
+{
+ // Red in the lowest byte of a native 32-bit pixel is Ogre's A8B8G8R8.
+ Ogre::Image image;
+ image.loadDynamicImage((Ogre::uchar*) &mPixels[0], mPixelWidth, mPixelHeight, 1, Ogre::PF_A8B8G8R8);
+ image.save(path);
+}
 
 // ----------------------------------------------------------------------------------------------------------------
 
@@ -31,6 +31,15 @@
 #include "OIS/OIS.h"
 #include "Gorilla.h"
 
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+#ifdef MONKEY_PROFILING
+# include <chrono>
+#endif
+
 
 namespace Monkey
 {
@@ -50,11 +59,22 @@ namespace Monkey
   ElementState_Hover
  };
 
+ enum NavigationDirection
+ {
+  Navigate_Up,
+  Navigate_Down,
+  Navigate_Left,
+  Navigate_Right,
+  Navigate_Next,
+  Navigate_Previous
+ };
+
  enum ElementType
  {
   ElementType_Block,
   ElementType_Button,
   ElementType_TextBox,
+  ElementType_List,
   ElementType_OSK_BEGIN,
   ElementType_OSKContainer,
   ElementType_OSKTitle,
@@ -64,9 +84,168 @@ namespace Monkey
   ElementType_OSK_END
  };
 
+ enum RecordDelta
+ {
+  RecordDelta_None       = 0,
+  RecordDelta_Geometry   = 1,
+  RecordDelta_Background = 2,
+  RecordDelta_Border     = 4,
+  RecordDelta_Text       = 8,
+  RecordDelta_Primitives = 16,
+  RecordDelta_All        = 0xFF
+ };
+
  typedef std::map<std::string, std::string> ElementArgs;
 
+ // Inclusive time spent in one kind of work; nested scopes of the same kind are not counted twice.
+ struct ProfileTimer
+ {
+  double microseconds;
+  size_t scopes;
+  unsigned int depth;
+ };
+
+ // Counters for the work done between two calls of PuzzleTree::update.
+ // The timers are only filled in when Monkey is built with MONKEY_PROFILING defined.
+ struct FrameStats
+ {
+  size_t elements_laid_out;
+  size_t elements_culled;
+  size_t reapply_looks;
+  size_t style_lookups;
+  size_t style_merges;
+  size_t primitives_created;
+  size_t primitives_destroyed;
+  size_t primitive_setter_calls;
+  size_t hit_tests;
+  size_t hit_test_elements_visited;
+  size_t callbacks_fired;
+  size_t commands_executed;
+  size_t bindings_applied;
+  ProfileTimer parse, cascade, layout, input;
+  void reset();
+  // Adds the counts and times of another, i.e. of a worker thread.
+  void add(const FrameStats&);
+ };
+
+ // Approximate bytes held by a PuzzleTree, object sizes plus their heap allocations.
+ struct MemoryUsage
+ {
+  size_t elements;    // Element objects, less their looks.
+  size_t looks;       // The normal, hover and active looks embedded in each element.
+  size_t styles;      // Named styles parsed from the stylesheets.
+  size_t strings;     // Heap held by IDs, titles, text, class names, inline styles and bindings.
+  size_t containers;  // Children maps, element indices, list rows, type tables, bindings and the command queue.
+  size_t listeners;   // Mouse listener entries.
+  size_t primitives;  // Render primitives, as reported by the backend.
+  MemoryUsage();
+  size_t total() const;
+  MemoryUsage& operator+=(const MemoryUsage&);
+ };
+
+ struct MemoryReport
+ {
+  // Shared by the whole tree; the styles, type tables, mouse pointer and the tree itself.
+  MemoryUsage tree;
+  // Each top-level element with its descendants, by ID.
+  std::vector<std::pair<Ogre::String, MemoryUsage> > elements;
+  MemoryUsage total;
+ };
+
+#ifdef MONKEY_PROFILING
+ class ProfileScope
+ {
+  public:
+   ProfileScope(ProfileTimer& timer) : mTimer(timer)
+   {
+    if (mTimer.depth++ == 0)
+     mStart = std::chrono::high_resolution_clock::now();
+   }
+  ~ProfileScope()
+   {
+    if (--mTimer.depth == 0)
+    {
+     mTimer.microseconds += std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - mStart).count();
+     mTimer.scopes++;
+    }
+   }
+  protected:
+   ProfileTimer& mTimer;
+   std::chrono::high_resolution_clock::time_point mStart;
+ };
+# define MONKEY_PROFILE(TREE, TIMER) ::Monkey::ProfileScope monkeyProfileScope_##TIMER((TREE)->_getFrameStats().TIMER)
+#else
+# define MONKEY_PROFILE(TREE, TIMER)
+#endif
+
+ // Trace events in the JSON trace-event format, viewable in chrome://tracing or Perfetto.
+ // Each thread records into its own fixed size ring buffer with no locking; once full the oldest
+ // events are overwritten. Scopes are only compiled in with MONKEY_TRACING defined, and only
+ // record while tracing is enabled.
+ class Trace
+ {
+  public:
+   
+   static void setEnabled(bool enabled) { sEnabled.store(enabled, std::memory_order_relaxed); }
+   
+   static bool isEnabled() { return sEnabled.load(std::memory_order_relaxed); }
+   
+   // Write every event recorded since the last clear, from all threads.
+   static void write(const Ogre::String& path);
+   
+   static void clear();
+   
+   // Microseconds on a monotonic clock.
+   static long long _now();
+   
+   static void _record(const char* name, const char* category, long long start, long long end, const Ogre::String* id, int type);
+   
+  protected:
+   
+   static std::atomic<bool> sEnabled;
+ };
+
+#ifdef MONKEY_TRACING
+ class TraceScope
+ {
+  public:
+   // The id is copied, as the element may be destroyed within the scope.
+   TraceScope(const char* name, const char* category, const Ogre::String* id = 0, int type = -1)
+   : mName(name), mCategory(category), mHasID(false), mType(type), mStart(Trace::isEnabled() ? Trace::_now() : -1)
+   {
+    if (mStart >= 0 && id)
+    {
+     mID = *id;
+     mHasID = true;
+    }
+   }
+  ~TraceScope()
+   {
+    if (mStart >= 0)
+     Trace::_record(mName, mCategory, mStart, Trace::_now(), mHasID ? &mID : 0, mType);
+   }
+  protected:
+   const char* mName;
+   const char* mCategory;
+   Ogre::String mID;
+   bool mHasID;
+   int mType;
+   long long mStart;
+ };
+# define MONKEY_TRACE(...) ::Monkey::TraceScope monkeyTraceScope(__VA_ARGS__)
+#else
+# define MONKEY_TRACE(...)
+#endif
+
+ struct ClipRect
+ {
+  float left, top, right, bottom;
+ };
+
  class Element;
+ class CascadePool;
+ struct MamlTemplate;
+ struct TemplateLook;
  struct ElementStyle;
  class PuzzleTree;
  
@@ -84,27 +263,706 @@ namespace Monkey
    
  };
  
+ class ListSource
+ {
+  public:
+   // Number of rows the list holds.
+   virtual size_t getRowCount(Monkey::Element* list) = 0;
+   // A recycled row element has been moved onto the row at index; fill it in.
+   virtual void bindRow(Monkey::Element* list, Monkey::Element* row, size_t index) = 0;
+ };
+ 
+ enum ElementEventType
+ {
+  ElementEvent_Activated,
+  ElementEvent_Focused,
+  ElementEvent_Blur,
+  ElementEvent_TextboxChanged
+ };
+ 
+ // A buffered Callback call; see PuzzleTree::setEventBuffering. The element is 0 once destroyed.
+ struct ElementEvent
+ {
+  ElementEventType type;
+  Element* element;
+  int x, y, buttons;
+ };
+ 
+ // The drawing primitives an Element is made of; implemented by each RenderBackend.
+ class RenderRectangle
+ {
+  public:
+   virtual ~RenderRectangle() {}
+   virtual void position(float left, float top) = 0;
+   virtual void size(float width, float height) = 0;
+   virtual void background_colour(const Ogre::ColourValue&) = 0;
+   virtual void background_image(Gorilla::Sprite*) = 0;
+   virtual void no_background() = 0;
+   virtual void border(float width, const Ogre::ColourValue& top, const Ogre::ColourValue& right, const Ogre::ColourValue& bottom, const Ogre::ColourValue& left) = 0;
+   virtual void no_border() = 0;
+ };
+ 
+ class RenderCaption
+ {
+  public:
+   virtual ~RenderCaption() {}
+   virtual void position(float left, float top) = 0;
+   virtual void size(float width, float height) = 0;
+   virtual void font(size_t) = 0;
+   virtual void colour(const Ogre::ColourValue&) = 0;
+   virtual void align(Gorilla::TextAlignment, Gorilla::VerticalAlignment) = 0;
+   virtual void text(const Ogre::String&) = 0;
+ };
+ 
+ // Everything a PuzzleTree draws with. Layers are 0 to 15, drawn in increasing order.
+ class RenderBackend
+ {
+  public:
+   virtual ~RenderBackend() {}
+   virtual float getWidth() const = 0;
+   virtual float getHeight() const = 0;
+   // Load the atlas named by a stylesheet's @import.
+   virtual void loadAtlas(const Ogre::String& atlas) = 0;
+   virtual Gorilla::Sprite* getSprite(const Ogre::String& name) = 0;
+   virtual Gorilla::GlyphData* getGlyphData(size_t font) = 0;
+   virtual RenderRectangle* createRectangle(size_t layer, float left, float top, float width, float height) = 0;
+   virtual void destroyRectangle(RenderRectangle*) = 0;
+   virtual RenderCaption* createCaption(size_t layer, size_t font, float left, float top, const Ogre::String& text) = 0;
+   virtual void destroyCaption(RenderCaption*) = 0;
+   // Approximate bytes held by a primitive, for memory reports.
+   virtual size_t getPrimitiveBytes(const RenderRectangle*) const { return 0; }
+   virtual size_t getPrimitiveBytes(const RenderCaption*) const { return 0; }
+ };
+ 
+ // Draws through a Gorilla screen on an Ogre viewport.
+ class GorillaBackend : public RenderBackend
+ {
+  public:
+   
+   // Note: If Gorilla's Silverback hasn't been created, GorillaBackend will create it.
+   GorillaBackend(Ogre::Viewport*);
+   
+  ~GorillaBackend();
+   
+   float getWidth() const;
+   float getHeight() const;
+   void loadAtlas(const Ogre::String& atlas);
+   Gorilla::Sprite* getSprite(const Ogre::String& name);
+   Gorilla::GlyphData* getGlyphData(size_t font);
+   RenderRectangle* createRectangle(size_t layer, float left, float top, float width, float height);
+   void destroyRectangle(RenderRectangle*);
+   RenderCaption* createCaption(size_t layer, size_t font, float left, float top, const Ogre::String& text);
+   void destroyCaption(RenderCaption*);
+   size_t getPrimitiveBytes(const RenderRectangle*) const;
+   size_t getPrimitiveBytes(const RenderCaption*) const;
+   
+   Gorilla::Silverback* getSilverback() const { return mSilverback; }
+   
+   Gorilla::Screen* getScreen() const { return mScreen; }
+   
+  protected:
+   
+   Gorilla::Silverback*                       mSilverback;
+   Gorilla::Screen*                           mScreen;
+   Ogre::Viewport*                            mViewport;
+   Gorilla::Layer*                            mLayers[16];
+ };
+ 
+ // Draws nothing; keeps every live primitive and its state in memory and counts the operations
+ // performed on them, so a PuzzleTree can run headless.
+ class RecordingBackend : public RenderBackend
+ {
+  public:
+   
+   struct Counters
+   {
+    size_t rectangles_created, rectangles_destroyed;
+    size_t captions_created, captions_destroyed;
+    size_t setter_calls;
+   };
+   
+   class Rectangle : public RenderRectangle
+   {
+    public:
+     void position(float left, float top);
+     void size(float width, float height);
+     void background_colour(const Ogre::ColourValue&);
+     void background_image(Gorilla::Sprite*);
+     void no_background();
+     void border(float width, const Ogre::ColourValue& top, const Ogre::ColourValue& right, const Ogre::ColourValue& bottom, const Ogre::ColourValue& left);
+     void no_border();
+     size_t layer;
+     float left, top, width, height;
+     Ogre::ColourValue background;
+     Gorilla::Sprite* sprite;
+     bool has_background;
+     float border_width;
+     Ogre::ColourValue border_top, border_right, border_bottom, border_left;
+     Counters* counters;
+     std::list<Rectangle*>::iterator it;
+   };
+   
+   class Caption : public RenderCaption
+   {
+    public:
+     void position(float left, float top);
+     void size(float width, float height);
+     void font(size_t);
+     void colour(const Ogre::ColourValue&);
+     void align(Gorilla::TextAlignment, Gorilla::VerticalAlignment);
+     void text(const Ogre::String&);
+     size_t layer;
+     float left, top, width, height;
+     size_t glyphs;
+     Ogre::ColourValue foreground;
+     Gorilla::TextAlignment horz;
+     Gorilla::VerticalAlignment vert;
+     Ogre::String string;
+     Counters* counters;
+     std::list<Caption*>::iterator it;
+   };
+   
+   RecordingBackend(float width, float height);
+   
+  ~RecordingBackend();
+   
+   float getWidth() const { return mWidth; }
+   float getHeight() const { return mHeight; }
+   void loadAtlas(const Ogre::String& atlas);
+   // Any sprite name and font index is accepted; placeholders are made on first use.
+   Gorilla::Sprite* getSprite(const Ogre::String& name);
+   Gorilla::GlyphData* getGlyphData(size_t font);
+   RenderRectangle* createRectangle(size_t layer, float left, float top, float width, float height);
+   void destroyRectangle(RenderRectangle*);
+   RenderCaption* createCaption(size_t layer, size_t font, float left, float top, const Ogre::String& text);
+   void destroyCaption(RenderCaption*);
+   size_t getPrimitiveBytes(const RenderRectangle*) const;
+   size_t getPrimitiveBytes(const RenderCaption*) const;
+   
+   const Counters& getCounters() const { return mCounters; }
+   
+   void resetCounters();
+   
+   // Live primitives of a layer, in creation order.
+   const std::list<Rectangle*>& getRectangles(size_t layer) const { return mRectangles[layer]; }
+   
+   const std::list<Caption*>& getCaptions(size_t layer) const { return mCaptions[layer]; }
+   
+  protected:
+   
+   float                                      mWidth, mHeight;
+   Ogre::String                               mAtlas;
+   Counters                                   mCounters;
+   std::list<Rectangle*>                      mRectangles[16];
+   std::list<Caption*>                        mCaptions[16];
+   std::map<Ogre::String, Gorilla::Sprite*>   mSprites;
+   std::map<size_t, Gorilla::GlyphData*>      mGlyphData;
+ };
+ 
+ // Rasterizes the live primitives of a RecordingBackend into an RGBA frame buffer on the CPU,
+ // using the atlas (.gorilla description and its texture) named by the stylesheet.
+ class SoftwareBackend : public RecordingBackend
+ {
+  public:
+   
+   SoftwareBackend(size_t width, size_t height);
+   
+   void loadAtlas(const Ogre::String& atlas);
+   // Only the sprites and fonts described by the atlas are known.
+   Gorilla::Sprite* getSprite(const Ogre::String& name);
+   Gorilla::GlyphData* getGlyphData(size_t font);
+   
+   void setClearColour(const Ogre::ColourValue&);
+   
+   // Draw every live primitive, layer by layer; rectangles before captions within a layer as Gorilla does.
+   void render();
+   
+   // One pixel per entry, red in the lowest byte and alpha in the highest.
+   const std::vector<Ogre::uint32>& getPixels() const { return mPixels; }
+   
+   void writePPM(const Ogre::String& path) const;
+   
+   void writePNG(const Ogre::String& path) const;
+   
+  protected:
+   
+   struct Glyph
+   {
+    int left, top, width, height;
+    float advance;
+    bool set;
+   };
+   
+   struct Font
+   {
+    float line_height, space_length, kerning;
+    Ogre::uint range_begin, range_end;
+    std::vector<Glyph> glyphs;
+    // 0 outside the font's range, as Gorilla loads no glyphs there, or if the glyph is not given.
+    const Glyph* find(Ogre::uint c) const
+    {
+     if (c < range_begin || c > range_end || c >= glyphs.size() || glyphs[c].set == false)
+      return 0;
+     return &glyphs[c];
+    }
+   };
+   
+   void _fill(int left, int top, int right, int bottom, Ogre::uint32 colour);
+   void _blit(int left, int top, int width, int height, int u, int v, int uw, int vh, Ogre::uint32 tint, const ClipRect&);
+   void _drawRectangle(const Rectangle*);
+   void _drawCaption(const Caption*);
+   
+   size_t                                     mPixelWidth, mPixelHeight;
+   std::vector<Ogre::uint32>                  mPixels;
+   size_t                                     mTextureWidth, mTextureHeight;
+   std::vector<Ogre::uint32>                  mTexture;
+   Ogre::uint32                               mClearColour;
+   std::map<size_t, Font>                     mFonts;
+ };
+ 
+ enum InputEventType
+ {
+  InputEvent_MouseMoved,
+  InputEvent_MousePressed,
+  InputEvent_MouseReleased,
+  InputEvent_KeyPress,
+  InputEvent_KeyBackspace,
+  InputEvent_KeySubmit,
+  InputEvent_KeyCancel
+ };
+ 
+ struct InputEvent
+ {
+  InputEventType type;
+  Ogre::uint64 time;   // Microseconds since recording began.
+  int x, y, z;         // Mouse position and wheel movement.
+  int buttons;         // OIS::MouseState::buttons.
+  int button;          // OIS::MouseButtonID of a press or release.
+  char character;
+ };
+ 
+ // Writes every input a PuzzleTree receives to a compact binary log; see PuzzleTree::setInputRecorder.
+ class InputRecorder
+ {
+  public:
+   
+   InputRecorder(const Ogre::String& path);
+   
+   bool isOpen() const { return mFile.good(); }
+   
+   size_t getEventCount() const { return mEvents; }
+   
+   void _recordMouse(InputEventType, const OIS::MouseState&, int button);
+   
+   void _recordKey(InputEventType, char character);
+   
+  protected:
+   
+   void _write(const InputEvent&);
+   
+   std::ofstream                              mFile;
+   Ogre::uint64                               mStart, mLast;
+   size_t                                     mEvents;
+ };
+ 
+ // Replays an input log against a PuzzleTree as fast as it will go, collecting the callbacks
+ // fired and the time spent handling each event.
+ class InputReplay
+ {
+  public:
+   
+   enum CallbackType { Callback_Activated, Callback_Focused, Callback_Blur, Callback_TextboxChanged };
+   
+   struct CallbackRecord
+   {
+    CallbackType type;
+    size_t event;         // Index of the input event that fired it.
+    Ogre::String id;
+    int element_type;
+   };
+   
+   InputReplay(const Ogre::String& path);
+   
+   bool isValid() const { return mValid; }
+   
+   const std::vector<InputEvent>& getEvents() const { return mEvents; }
+   
+   // The tree's own callback still receives every call.
+   void run(PuzzleTree*);
+   
+   const std::vector<CallbackRecord>& getCallbacks() const { return mCallbacks; }
+   
+   // Microseconds taken by each event of the last run.
+   const std::vector<double>& getEventTimes() const { return mEventTimes; }
+   
+   double getTotalTime() const { return mTotalTime; }
+   
+  protected:
+   
+   bool                                       mValid;
+   std::vector<InputEvent>                    mEvents;
+   std::vector<CallbackRecord>                mCallbacks;
+   std::vector<double>                        mEventTimes;
+   double                                     mTotalTime;
+ };
+ 
+ // One line of MAML; parent is the index of the parent node, or npos for a top-level element.
+ struct MamlNode
+ {
+  size_t parent;
+  Ogre::String selectors;
+  int type;
+  ElementArgs args;
+  Ogre::String text;
+  bool has_text;
+ };
+ 
+ // The MAML nodes a file was last made from, and the element made for each, or 0 once destroyed.
+ // See PuzzleTree::maml.
+ struct MamlDocument
+ {
+  std::vector<MamlNode> nodes;
+  std::vector<Element*> elements;
+ };
+ 
+ // A MAML file or stylesheet read on a background thread, away from the PuzzleTree's elements and
+ // primitives; MAML elements are made and cascaded but not laid out. See PuzzleTree::mamlAsync.
+ class DetachedTree
+ {
+  public:
+   
+   // Waits for the background thread; elements not yet attached are destroyed.
+  ~DetachedTree();
+   
+   // The background thread has finished.
+   bool isReady() const { return mReady.load(std::memory_order_acquire); }
+   
+   void wait();
+   
+   // Top-level elements attached so far, and in all.
+   size_t getAttached() const { return mAttached; }
+   
+   size_t getRoots() const { return mRoots.size(); }
+   
+  protected:
+   
+   friend class PuzzleTree;
+   
+   DetachedTree();
+   
+   std::thread                                mThread;
+   std::atomic<bool>                          mReady;
+   Ogre::String                               mAtlas;
+   Ogre::String                               mCSS;
+   std::vector<std::pair<Ogre::String, ElementStyle*> > mRules;
+   std::vector<std::pair<Ogre::String, MamlTemplate*> > mTemplates;
+   std::vector<Element*>                      mRoots;
+   size_t                                     mAttached;
+   bool                                       mCommitted;
+   FrameStats                                 mStats;
+ };
+ 
+ // A stylesheet parsed once and shared, unchanged, by any number of PuzzleTrees, which may be on other
+ // threads. Each tree looks up its sprites and fonts and layers the rules of its own loadCSS on top. It
+ // must outlive the trees using it.
+ class StyleSheet
+ {
+  public:
+   
+   StyleSheet(const Ogre::String& monkey_css);
+   
+  ~StyleSheet();
+   
+   const ElementStyle* getStyle(const Ogre::String& name) const;
+   
+   const Ogre::String& getAtlas() const { return mAtlas; }
+   
+   size_t getStyleCount() const { return mStyles.size(); }
+   
+  protected:
+   
+   friend class PuzzleTree;
+   
+   Ogre::String                               mAtlas;
+   std::map<Ogre::String, ElementStyle*>      mStyles;
+ };
+ 
+ // A value elements are bound to in MAML; bind="player.hp" binds the text and bind-class="player.state"
+ // a class named after the value. Once added with PuzzleTree::addObservable, a changed value reaches
+ // its bound elements on the next PuzzleTree::update. Remove it from the tree before destroying it.
+ class Observable
+ {
+  public:
+   
+   Observable() : mTree(0), mDirty(false) {}
+   
+   virtual ~Observable() {}
+   
+   virtual Ogre::String format() const = 0;
+   
+   // Queues the bound elements for the next update.
+   void _changed();
+   
+  protected:
+   
+   friend class PuzzleTree;
+   
+   PuzzleTree*                                mTree;
+   Ogre::String                               mName;
+   bool                                       mDirty;
+ };
+ 
+ // Compared on the value itself, so setting an unchanged value costs nothing further.
+ template<typename T> class ObservableValue : public Observable
+ {
+  public:
+   
+   ObservableValue(const T& value = T()) : mValue(value) {}
+   
+   void set(const T& value)
+   {
+    if (value == mValue)
+     return;
+    mValue = value;
+    _changed();
+   }
+   
+   const T& get() const { return mValue; }
+   
+   Ogre::String format() const
+   {
+    std::stringstream s;
+    s << mValue;
+    return s.str();
+   }
+   
+  protected:
+   
+   T mValue;
+ };
+ 
+ // MAML being made a little at a time by PuzzleTree::update; see PuzzleTree::mamlIncremental.
+ // Its elements are laid out and have their primitives as they are made, but draw nothing until
+ // the whole of it is made.
+ class Instantiation
+ {
+  public:
+   
+   size_t getMade() const { return mNext; }
+   
+   size_t getTotal() const { return mNodes.size(); }
+   
+   float getProgress() const { return mNodes.size() ? float(mNext) / float(mNodes.size()) : 1.0f; }
+   
+   bool isComplete() const { return mNext == mNodes.size(); }
+   
+   // Top-level elements made so far.
+   const std::vector<Element*>& getRoots() const { return mRoots; }
+   
+  protected:
+   
+   friend class PuzzleTree;
+   
+   ~Instantiation() {}
+   
+   std::vector<MamlNode>                      mNodes;
+   std::vector<Element*>                      mElements;
+   std::vector<Element*>                      mRoots;
+   size_t                                     mNext;
+ };
+ 
+ // Lets other threads change a PuzzleTree. Any number of threads may push commands, which the tree
+ // runs in the order they were pushed during PuzzleTree::update. The queue is a bounded lock-free ring;
+ // text is copied into one of two fixed arenas that swap on updates, so pushing never allocates. An
+ // arena is reused once every command with text in it has run. A push fails when the ring or the
+ // arena is full.
+ class CommandQueue
+ {
+  public:
+   
+   enum CommandType
+   {
+    Command_SetText,
+    Command_SetState,
+    Command_Show,
+    Command_Hide,
+    Command_AddClass,
+    Command_RemoveClass,
+    Command_Create,
+    Command_Destroy
+   };
+   
+   // Capacity is rounded up to a power of two; each of the two arenas holds text_bytes.
+   CommandQueue(size_t capacity, size_t text_bytes);
+   
+  ~CommandQueue();
+   
+   bool setText(Element*, const Ogre::String& text);
+   
+   bool setState(Element*, ElementState);
+   
+   bool show(Element*);
+   
+   bool hide(Element*);
+   
+   bool addClass(Element*, const Ogre::String& name);
+   
+   bool removeClass(Element*, const Ogre::String& name);
+   
+   // A top-level element when parent is 0. If created is given the new element is written to it
+   // by the update that runs the command.
+   bool create(Element* parent, const Ogre::String& id_and_or_classes, int type, Element** created = 0);
+   
+   // No command for the element, or its descendants, may be pushed after this one.
+   bool destroy(Element*);
+   
+   // Pushes that failed because the ring or the arena was full.
+   size_t getDropped() const { return mDropped.load(std::memory_order_relaxed); }
+   
+   // The ring and both arenas.
+   size_t getBytes() const { return sizeof(CommandQueue) + (mMask + 1) * sizeof(Cell) + 2 * mArenaSize; }
+   
+   // Render thread only. Runs the queued commands on the tree and returns how many were run.
+   size_t _drain(PuzzleTree*);
+   
+  protected:
+   
+   struct Command
+   {
+    CommandType type;
+    Element* element;
+    int value;                      // ElementState or element type.
+    Element** created;
+    size_t arena, offset, length;   // Text within an arena.
+   };
+   
+   struct Cell
+   {
+    std::atomic<size_t> sequence;
+    Command command;
+   };
+   
+   struct Arena
+   {
+    char* text;
+    std::atomic<size_t> used;
+    std::atomic<size_t> writers;
+   };
+   
+   bool _push(Command&, const Ogre::String* text = 0);
+   
+   Cell*                                      mCells;
+   size_t                                     mMask;
+   std::atomic<size_t>                        mEnqueue;
+   size_t                                     mDequeue;
+   Arena                                      mArenas[2];
+   size_t                                     mArenaSize;
+   std::atomic<size_t>                        mArena;
+   size_t                                     mRetired;  // Tickets below it may use the other arena's text.
+   bool                                       mRetiring;
+   std::atomic<size_t>                        mDropped;
+ };
+ 
  class PuzzleTree 
  {
    
   public:
    
    friend class Element;
+   friend class CascadePool;
+   friend class Observable;
    
    // PuzzleTree constructor. 
    // Note: If Gorilla's Silverback hasn't been created, PuzzleTree will create it.
    PuzzleTree(const Ogre::String& monkey_css, Ogre::Viewport*, Callback* callback);
    
+   // PuzzleTree constructor drawing through any backend, i.e. a RecordingBackend to run without a GPU.
+   // The backend is not owned by the PuzzleTree.
+   PuzzleTree(const Ogre::String& monkey_css, RenderBackend*, Callback* callback);
+   
+   // Styled by a shared StyleSheet, which is not owned.
+   PuzzleTree(const StyleSheet*, Ogre::Viewport*, Callback* callback);
+   
+   PuzzleTree(const StyleSheet*, RenderBackend*, Callback* callback);
+   
   ~PuzzleTree();
    
    Element* createElement(const Ogre::String& css_id_or_classes, int type, const ElementArgs& args = ElementArgs());
    
+   // Destroys an element, its children and their primitives.
+   void destroyElement(Element* element);
+   
    Callback* getCallback() const { return mCallback; }
    
+   void setCallback(Callback* callback) { mCallback = callback; }
+   
+   // When buffered, the calls to element listeners and the Callback are kept as events until
+   // dispatchEvents or pollEvents instead of being made in the middle of input handling.
+   void setEventBuffering(bool buffered) { mBufferEvents = buffered; }
+   
+   bool getEventBuffering() const { return mBufferEvents; }
+   
+   // Events buffered since the last poll; valid until the next.
+   const std::vector<ElementEvent>& pollEvents();
+   
+   // Polls, then calls each event's element listener and the Callback. They may restyle or destroy elements.
+   void dispatchEvents();
+   
+   // Every input received is written to the recorder, or nothing if 0. The recorder is not owned.
+   void setInputRecorder(InputRecorder* recorder) { mInputRecorder = recorder; }
+   
+   InputRecorder* getInputRecorder() const { return mInputRecorder; }
+   
+   // Makes the elements of a MAML file. Given the same file again, the elements made from it are
+   // reconciled with the new revision, matched by ID and then by position; only what changed is made,
+   // destroyed, restyled or given new text.
    void maml(const Ogre::String& maml_string);
    
    void loadCSS(const Ogre::String& monkey_css);
    
+   // Loads a stylesheet and then reloads it whenever its file changes, checked by update. Changed rules
+   // replace the old ones and only the elements using them, and their descendants, are restyled. The
+   // file must be in a FileSystem resource location; returns false if it is not.
+   bool watchCSS(const Ogre::String& monkey_css);
+   
+   void unwatchCSS(const Ogre::String& monkey_css);
+   
+   // Makes the elements of a MAML "@template name" block under parent, or at the top if 0, replacing
+   // each {key} in their selectors, arguments and text with params[key]. Templates are compiled on
+   // first use and again for another parent, or after a stylesheet is loaded or the parent restyled.
+   // Returns the first element made, or 0 if there is no such template.
+   Element* instantiate(const Ogre::String& name, Element* parent = 0, const ElementArgs& params = ElementArgs());
+   
+   // Reads a MAML file now but makes its elements during the following updates, within the
+   // instantiation budget of each. The Instantiation is owned by the tree until destroyInstantiation.
+   Instantiation* mamlIncremental(const Ogre::String& maml_path);
+   
+   // Stops an incomplete Instantiation, drawing the elements it has made so far, and deletes it.
+   void destroyInstantiation(Instantiation*);
+   
+   // The observable is not owned; its name is the one used by bind and bind-class in MAML.
+   void addObservable(const Ogre::String& name, Observable*);
+   
+   void removeObservable(const Ogre::String& name);
+   
+   // Microseconds each update may spend making elements; at least one element is made per update.
+   void setInstantiationBudget(double microseconds) { mInstantiationBudget = microseconds; }
+   
+   double getInstantiationBudget() const { return mInstantiationBudget; }
+   
+   // Reads, makes and cascades a MAML file on a background thread. Files are read through the
+   // ResourceGroupManager there, so Ogre must be built with thread support. The stylesheets must not
+   // change until the DetachedTree is ready.
+   DetachedTree* mamlAsync(const Ogre::String& maml_path);
+   
+   // Reads a stylesheet on a background thread; attach adds its rules.
+   DetachedTree* loadCSSAsync(const Ogre::String& monkey_css);
+   
+   // Moves a ready DetachedTree into the tree, registering its elements and making their primitives.
+   // Returns false while it is not ready, or when the budget in milliseconds ran out after a top-level
+   // element; call again on a later frame. Once true, the DetachedTree has been deleted.
+   bool attach(DetachedTree*, double budget_ms = 0);
+   
    void mouseMoved( const OIS::MouseEvent &arg );
    
    void mousePressed( const OIS::MouseEvent &arg, OIS::MouseButtonID id );
@@ -119,22 +977,81 @@ namespace Monkey
    
    void onKeyCancel();
    
-   Gorilla::Silverback*  getSilverback() const { return mSilverback; }
+   // Only when drawing through a GorillaBackend, otherwise 0.
+   Gorilla::Silverback*  getSilverback() const { return mGorillaBackend ? mGorillaBackend->getSilverback() : 0; }
 
-   Gorilla::Screen* getScreen() const { return mScreen; }
+   Gorilla::Screen* getScreen() const { return mGorillaBackend ? mGorillaBackend->getScreen() : 0; }
+   
+   RenderBackend* getBackend() const { return mBackend; }
 
    void dumpCSS();
 
    void dumpElements();
+   
+   // Bytes used by the tree, broken down per top-level element.
+   void getMemoryReport(MemoryReport&) const;
+   
+   void dumpMemory() const;
+   
+   // Call once per frame; runs the queued commands and rolls the current frame's statistics over.
+   void update();
+   
+   // Safe to push to from any thread.
+   CommandQueue* getCommandQueue() const { return mCommands; }
+   
+   // With more than one thread, maml() makes every element first and then cascades sibling subtrees in
+   // parallel on a pool of that many threads, the calling thread included. Primitives are still made on
+   // the calling thread once the cascade is done. One (the default) cascades each element as it is made.
+   void setCascadeThreads(size_t threads);
+   
+   size_t getCascadeThreads() const { return mCascadeThreads; }
+   
+   // The statistics counted by this thread; a cascade worker counts into its own until the cascade ends.
+   FrameStats& _getFrameStats() { return sWorkerFrameStats ? *sWorkerFrameStats : mFrameStats; }
+   
+   // Statistics of the last completed frame.
+   const FrameStats& getFrameStats() const { return mLastFrameStats; }
 
+   // The tree's own rule of that name; shared StyleSheet rules are not returned. It is deleted when
+   // a later stylesheet or reload replaces or removes the rule.
    ElementStyle* getStyle(const Ogre::String& name)
    {
+    _getFrameStats().style_lookups++;
     std::map<Ogre::String, ElementStyle*>::iterator it = mStyles.find(name);
     if (it == mStyles.end())
      return 0;
     return (*it).second;
    }
    
+   // The tree's rule of that name, or else the shared StyleSheet's.
+   const ElementStyle* _findStyle(const Ogre::String& name)
+   {
+    _getFrameStats().style_lookups++;
+    std::map<Ogre::String, ElementStyle*>::iterator it = mStyles.find(name);
+    if (it != mStyles.end())
+     return (*it).second;
+    return mStyleSheet ? mStyleSheet->getStyle(name) : 0;
+   }
+   
+   // While a modal scope is pushed, only its subtree is hit tested, scrolled and may begin text mode.
+   // Text mode pushes the OSK as one, and pushing another ends text mode unless its text box is inside;
+   // then the new scope goes beneath the OSK.
+   void pushScope(Element* root);
+   
+   void popScope();
+   
+   Element* getScope() const { return mScopes.empty() ? 0 : mScopes.back(); }
+   
+   // Moves the focus, as the mouse would, to the nearest listening element in the top scope that way, or
+   // the next or previous in reading order. Neighbours are cached until the layout changes. Returns the
+   // focused element, or 0 if there is nothing to focus.
+   Element* navigate(NavigationDirection);
+   
+   // Activates the focused element as a click would.
+   void activateFocus();
+   
+   Element* getFocus() const { return mLastEventElement; }
+   
    void beginTextMode(Element*);
    
    void endTextMode();
@@ -149,24 +1066,218 @@ namespace Monkey
    
   protected:
    
+   void _construct(const Ogre::String& monkey_css, const StyleSheet*);
+   
+   Element* _createElement(const Ogre::String& css_id_or_classes, int type, const ElementArgs& args, bool detached, const TemplateLook* look = 0);
+   
+   void _buildMaml(const std::vector<MamlNode>&, bool detached, std::vector<Element*>& roots, MamlDocument* = 0);
+   
+   void _reconcile(MamlDocument*, const std::vector<MamlNode>&);
+   
+   // Matches the children of a node of the document's last revision with those of a new node, npos being
+   // the top level, and makes or updates elements for the new ones.
+   void _reconcileChildren(MamlDocument*, const std::vector<MamlNode>&, const std::vector<std::vector<size_t> >& before, const std::vector<std::vector<size_t> >& after, size_t before_parent, size_t after_parent, Element* parent, std::vector<Element*>& elements);
+   
+   // The rules replace those of the same name, whichever stylesheet they came from.
+   void _commitCSS(const Ogre::String& atlas, const std::vector<std::pair<Ogre::String, ElementStyle*> >& rules, const Ogre::String& file);
+   
+   // Makes the mouse pointer, or restyles it, from the "mousepointer" rule.
+   void _stylePointer();
+   
+   // A stylesheet watched for changes; rules holds the declarations of each rule as last loaded.
+   struct WatchedCSS
+   {
+    Ogre::String resource, path, file;
+    int watch;
+    time_t modified;
+    std::map<Ogre::String, Ogre::String> rules;
+   };
+   
+   void _checkWatchedCSS();
+   
+   void _reloadCSS(WatchedCSS&);
+   
+   Element* _instantiateTemplate(MamlTemplate*, Element* parent, const ElementArgs& params);
+   
+   // Makes required.maml, and so the OSK, if it has not been made; false if there is still no OSK.
+   bool _requireOSK();
+   
+   Element* _getSingleton(int type) const;
+   
+   // Removes a scope wherever it is in the stack.
+   void _removeScope(Element* root);
+   
+   bool _inScope(Element*) const;
+   
+   // A visible element's box, clipped, in depth-first order. Only targets are hit: elements under a
+   // listener that allow pointer events and are listening or draw a rectangle; so transparent wrappers
+   // pass hits to their children. reach bounds the targets of the subtree, which ends before end.
+   struct HitBox
+   {
+    float left, top, right, bottom;
+    float reach_left, reach_top, reach_right, reach_bottom;
+    Element* element;
+    size_t end, depth;
+    bool target, interactive, listened;
+   };
+   
+   void _buildHitBoxes();
+   
+   void _addHitBoxes(Element*, bool listened, size_t depth);
+   
+   // The element's own box and whether it is a target; its reach is left to _addHitBoxes.
+   void _boxHit(Element*, bool listened, HitBox&) const;
+   
+   // Marks the hit boxes dirty if the element is no longer boxed as they were built.
+   void _touchHitBox(Element*);
+   
+   // The deepest target at x, y among boxes begin to end, skipping subtrees without one there.
+   Element* _hitTest(float x, float y, size_t begin, size_t end);
+   
+   // A listening target of the hit boxes and its neighbours, by NavigationDirection; npos for none.
+   struct NavNode
+   {
+    Element* element;
+    float x, y;
+    size_t neighbours[6];
+   };
+   
+   void _buildNavigation();
+   
+   // Clicks; false if the click ended text mode.
+   bool _activate(Element*, const OIS::MouseState*);
+   
+   void _commitTemplates(const std::vector<std::pair<Ogre::String, MamlTemplate*> >&);
+   
+   // Cascades, under parent, the template nodes that take no parameters in their selectors or style,
+   // nor have an ancestor in the template that does.
+   void _compileTemplate(MamlTemplate*, Element* parent);
+   
+   // Makes the queued MAML elements the budget allows.
+   void _instantiate();
+   
+   struct Binding
+   {
+    Observable* observable;
+    std::vector<Element*> text, classes;
+   };
+   
+   // Binds an element to its observables; their current values are given to it without a layout.
+   void _bind(Element*);
+   
+   void _unbind(Element*);
+   
+   void _commitBindings();
+   
+   // Looks the style's sprite and font up in the atlas unless already known, reporting unknown ones
+   // once. Main thread only, while nothing cascades.
+   void _resolveNames(const ElementStyle&, const Ogre::String& name);
+   
+   // Gives the style the sprite and glyphs of its names; safe on cascade workers.
+   void _resolveStyle(ElementStyle*, const Ogre::String& name);
+   
+   RenderRectangle* _createRectangle(size_t layer, float left, float top, float width, float height)
+   {
+    mFrameStats.primitives_created++;
+    return mBackend->createRectangle(layer, left, top, width, height);
+   }
+   
+   void _destroyRectangle(RenderRectangle* rectangle)
+   {
+    mFrameStats.primitives_destroyed++;
+    mBackend->destroyRectangle(rectangle);
+   }
+   
+   RenderCaption* _createCaption(size_t layer, size_t font, float left, float top, const Ogre::String& text)
+   {
+    mFrameStats.primitives_created++;
+    return mBackend->createCaption(layer, font, left, top, text);
+   }
+   
+   void _destroyCaption(RenderCaption* caption)
+   {
+    mFrameStats.primitives_destroyed++;
+    mBackend->destroyCaption(caption);
+   }
+   
    void _checkMouse(const OIS::MouseEvent &arg, OIS::MouseButtonID id, int ois_event, ElementState state);
+   
+   // Leaves text mode without changing the text box.
+   void _cancelTextMode();
+   
+   // Calls the element's listener and the Callback, or buffers the event.
+   void _fire(ElementEventType, Element*, const OIS::MouseState*);
+   
+   void _deliver(ElementEventType, Element*, const OIS::MouseState&);
+   
+   // An element whose callbacks are being made; deliveries nest when a callback fires another event.
+   struct Delivery
+   {
+    Element* element;
+    bool destroyed;
+    Delivery* outer;
+   };
+   
+   // Drops every reference the tree holds to an element being destroyed.
+   void _forgetElement(Element*);
+   
+   // Cascades and lays out the elements made while deferring.
+   void _cascadeDeferred();
 
    std::vector<Element*>                      mMouseListenerElements;
    std::multimap<Ogre::String, Element*>      mElements;
    std::map<Ogre::String, ElementStyle*>      mStyles;
-   Gorilla::Silverback*                       mSilverback;
-   Gorilla::Screen*                           mScreen;
-   Ogre::Viewport*                            mViewport;
-   Gorilla::Layer*                            mLayers[16];
+   RenderBackend*                             mBackend;
+   GorillaBackend*                            mGorillaBackend;
    Ogre::String                               mAtlas;
+   bool                                       mAtlasLoaded;
    OIS::Mouse*                                mMouse;
-   Gorilla::Rectangle*                        mMousePointer;
+   RenderRectangle*                           mMousePointer;
    Callback*                                  mCallback;
+   InputRecorder*                             mInputRecorder;
+   CommandQueue*                              mCommands;
    Element*                                   mLastEventElement;
    Element*                                   mCurrentTextElement;
    std::string                                mCurrentTextString;
    std::map<int, std::string>                 mElementTypes;
    std::map<int, Element*>                    mSingletonElements;
+   std::vector<Element*>                      mListElements;
+   FrameStats                                 mFrameStats;
+   FrameStats                                 mLastFrameStats;
+   size_t                                     mCascadeThreads;
+   CascadePool*                               mCascadePool;
+   bool                                       mDeferCascade;
+   std::vector<Element*>                      mDeferred;
+   std::mutex                                 mResolveMutex;
+   std::map<Ogre::String, Gorilla::Sprite*>   mSprites;        // Resolved by _resolveNames; 0 if unknown.
+   std::map<size_t, Gorilla::GlyphData*>      mGlyphs;
+   std::map<Ogre::String, Gorilla::Sprite*>   mLateSprites;    // Names first seen by a cascade, under mResolveMutex.
+   std::map<size_t, Gorilla::GlyphData*>      mLateGlyphs;
+   std::vector<Instantiation*>                mInstantiations;
+   std::map<Ogre::String, Binding>            mBindings;
+   std::vector<Observable*>                   mChangedObservables;
+   bool                                       mBufferEvents;
+   std::vector<ElementEvent>                  mEvents, mPolledEvents;
+   Delivery*                                  mDelivering;
+   double                                     mInstantiationBudget;
+   bool                                       mVeilNew;  // Main thread only; detached elements are never veiled.
+   std::map<Ogre::String, MamlTemplate*>      mTemplates;
+   std::map<Ogre::String, MamlDocument*>      mDocuments;
+   size_t                                     mStyleGeneration;
+   std::atomic<size_t>                        mCascadeCount;
+   std::vector<WatchedCSS>                    mWatchedCSS;
+   std::map<Ogre::String, Ogre::String>       mStyleFiles;  // The stylesheet each rule of mStyles came from.
+   const StyleSheet*                          mStyleSheet;
+   MamlTemplate*                              mOSKTemplate;
+   std::vector<Element*>                      mScopes;
+   std::vector<HitBox>                        mHitBoxes;
+   bool                                       mHitBoxesDirty;
+   std::vector<NavNode>                       mNavNodes;
+   bool                                       mNavDirty;
+   Element*                                   mNavScope;
+   size_t                                     mNavFirst;
+   int                                        mInotify;
+   static thread_local FrameStats*            sWorkerFrameStats;
   };
   
   struct ElementStyle
@@ -177,11 +1288,13 @@ namespace Monkey
     BackgroundType type;
     Ogre::ColourValue colour;
     Ogre::String sprite;
+    Gorilla::Sprite* sprite_data;
     bool set;
    } background;
    Ogre::ColourValue colour;
    bool colour_set;
    size_t font;
+   Gorilla::GlyphData* glyph_data;
    bool font_set;
    struct TextAligment
    {
@@ -209,10 +1322,25 @@ namespace Monkey
    float top;
    Unit top_unit;
    bool top_set;
+   bool overflow_hidden;
+   bool overflow_set;
+   // pointer-events; inherited, and taken from the normal look.
+   bool pointer_events;
+   bool pointer_events_set;
    void reset();
    void to_css(Ogre::String&);
    void from_css(const Ogre::String& key, const Ogre::String& value);
-   void merge(ElementStyle*, bool isParent);
+   void merge(ElementStyle*, bool isParent) const;
+  };
+
+  // Geometry and look of an Element in one state, resolved by reapplyLook so a change of
+  // state only has to push the differences to the render primitives.
+  struct RenderRecord
+  {
+   float left, top, width, height;
+   ElementStyle* look;
+   bool has_rectangle;
+   unsigned int compare(const RenderRecord&) const;
   };
 
   class Element
@@ -220,7 +1348,11 @@ namespace Monkey
     
    public:
     
-    Element(const std::string& id_and_or_classes, Gorilla::Layer*, PuzzleTree*, Element*, size_t index, int type, const ElementArgs& args);
+    friend class PuzzleTree;
+    
+    // A detached element is kept out of the tree's indices and makes no primitives until attached.
+    // A template look, if given, replaces the selectors and the cascade; see PuzzleTree::instantiate.
+    Element(const std::string& id_and_or_classes, PuzzleTree*, Element*, size_t index, int type, const ElementArgs& args, bool detached = false, const TemplateLook* look = 0);
     
    ~Element();
     
@@ -244,6 +1376,12 @@ namespace Monkey
     {
      return mIsVisible;
     }
+    
+    // Element lies entirely outside the screen or an overflow: hidden ancestor.
+    bool isCulled() const
+    {
+     return mCulled;
+    }
 
     bool hasParent() const
     {
@@ -259,18 +1397,43 @@ namespace Monkey
     
     void listen()
     {
+     mListening = true;
+     mTree->mHitBoxesDirty = true;
      mTree->mMouseListenerElements.push_back(this);
     }
     
     void unlisten()
     {
+     mListening = false;
+     mTree->mHitBoxesDirty = true;
      mTree->mMouseListenerElements.erase(std::find(mTree->mMouseListenerElements.begin(), mTree->mMouseListenerElements.end(), this));
     }
 
     void setState(ElementState state)
     {
+     if (state == mState)
+      return;
+     
+     if (mCulled)
+     {
+      mState = state;
+      return;
+     }
+     
+     if (mIsVisible == false || mRecordsValid == false)
+     {
+      mState = state;
+      reapplyLook();
+      return;
+     }
+     
+     unsigned int delta = mRecordDeltas[mState][state];
      mState = state;
-     reapplyLook();
+     
+     if (delta & (RecordDelta_Geometry | RecordDelta_Primitives))
+      reapplyLook();
+     else if (delta != RecordDelta_None)
+      _applyRecord(mRecords[mState], delta);
     }
 
     ElementState getState() const
@@ -285,46 +1448,52 @@ namespace Monkey
 
     void debug(size_t index = 0);
     
+    // Adds the bytes used by this element and its descendants.
+    void getMemoryUsage(MemoryUsage&) const;
+    
     Element* intersectionTest(int left, int top);
     
+    // List elements only. Rows are a small pool of child elements recycled as the list scrolls.
+    void setListSource(ListSource*);
+    
+    ListSource* getListSource() const { return mListSource; }
+    
+    void setListScroll(float pixels);
+    
+    void scrollList(float pixels) { setListScroll(mListScroll + pixels); }
+    
+    float getListScroll() const { return mListScroll; }
+    
+    float getListRowHeight() const { return mListRowHeight; }
+    
+    // Row count or row contents changed; rebinds the visible rows.
+    void refreshList();
+    
+    // Index of the row a list row element is bound to, or npos.
+    size_t getListRowIndex() const { return mListIndex; }
+    
     void setText(const Ogre::String& text)   { mText = text; reapplyLook(); }
     
-    Ogre::String getID() const { return mID; }
+    const Ogre::String& getID() const { return mID; }
     
     float getScreenLeft() const
     {
-     if (mRectangle)
-      return mRectangle->left();
-     else if (mCaption)
-      return mCaption->left();
-     return 0;
+     return mRecordsValid ? mRecords[mState].left : 0;
     }
     
     float getScreenTop() const
     {
-     if (mRectangle)
-      return mRectangle->top();
-     else if (mCaption)
-      return mCaption->top();
-     return 0;
+     return mRecordsValid ? mRecords[mState].top : 0;
     }
 
     float getScreenWidth() const
     {
-     if (mRectangle)
-      return mRectangle->width();
-     else if (mCaption)
-      return mCaption->width();
-     return 0;
+     return mRecordsValid ? mRecords[mState].width : 0;
     }
     
     float getScreenHeight() const
     {
-     if (mRectangle)
-      return mRectangle->height();
-     else if (mCaption)
-      return mCaption->width();
-     return 0;
+     return mRecordsValid ? mRecords[mState].height : 0;
     }
     
     Ogre::String getTitle() const { return mTitle; }
@@ -341,25 +1510,151 @@ namespace Monkey
     
     void refreshLook(ElementStyle*, const Ogre::String& id_and_or_classes);
     
+    // Classes are named with or without the leading '.'; the element and its children are restyled.
+    void addClass(const Ogre::String& name);
+    
+    void removeClass(const Ogre::String& name);
+    
+    bool hasClass(const Ogre::String& name) const;
+    
+    // Runs the cascade again for this element and its descendants, i.e. after the styles have changed.
+    void restyle();
+    
+    // Runs the deferred cascade of this element and appends its children, whose cascade may run next.
+    void _cascadePending(std::vector<Element*>& children);
+    
+    // Registers a detached element and its descendants with the tree.
+    void _attach();
+    
+    // Called for this element's events before the tree's Callback; not owned.
+    void setListener(Callback* listener) { mListener = listener; }
+    
+    Callback* getListener() const { return mListener; }
+    
+    // True for the element itself too.
+    bool isDescendantOf(const Element* ancestor) const;
+    
+    bool isDetached() const { return mDetached; }
+    
+    // Made by an incomplete Instantiation; primitives are laid out but draw nothing.
+    bool isVeiled() const { return mVeiled; }
+    
+    // Paints the primitives of this element and its descendants.
+    void _unveil();
+    
    void merge_style(const std::string& name, ElementStyle*, bool isParent);
+   
+   void merge_style(const ElementStyle* from, ElementStyle* to, bool isParent)
+   {
+    mTree->_getFrameStats().style_merges++;
+    from->merge(to, isParent);
+   }
 
    protected:
     
+    void _cascade();
+    
+    void _restyle();
+    
+    void _register();
+    
+    // Restyles this element if its cascade reads any of the named rules, otherwise looks at its children.
+    void _restyleUsing(const std::set<Ogre::String>& names);
+    
+    // Splits MAML selectors into mStyles and mID.
+    void _parseSelectors(const std::string& id_and_or_classes);
+    
+    Element* _createChild(const std::string& id_and_or_classes, int type, const ElementArgs& args, const TemplateLook* look);
+    
+    // Replaces the class given by a bind-class observable.
+    void _setBoundClass(const Ogre::String& value, bool restyle);
+    
+    void _computeRecord(ElementStyle*, RenderRecord&);
+    
+    void _applyRecord(const RenderRecord&, unsigned int delta);
+    
+    void _translate(float x, float y);
+    
+    size_t _cull();
+    
+    bool _clipContains(const RenderRecord&) const;
+    
+    // mClip from the parent, and mChildClip from it and the current record.
+    void _updateClip();
+    
+    // The part of a sprite stretched over unclipped that shows within record.
+    Gorilla::Sprite* _clipSprite(Gorilla::Sprite*, const RenderRecord& unclipped, const RenderRecord& record);
+    
+    void _layoutList(bool apply);
+    
     int                                        mType;
     PuzzleTree*                                mTree;
     Element*                                   mParent;
     std::multimap<Ogre::String, Element*>      mChildren;
     Ogre::String                               mID;
     std::vector<Ogre::String>                  mStyles;
+    Ogre::String                               mInlineStyle;
     ElementState                               mState;
     ElementStyle                               mLookNormal, mLookActive, mLookHover;
-    Gorilla::Caption*                          mCaption;
-    Gorilla::Rectangle*                        mRectangle;
+    RenderCaption*                             mCaption;
+    RenderRectangle*                           mRectangle;
+    Gorilla::Sprite*                           mClippedSprite;  // The background sprite cropped to the clip rectangle.
     Ogre::String                               mText;
-    Gorilla::Layer*                            mLayer;
     size_t                                     mIndex;
     Ogre::String                               mTitle;
     bool                                       mIsVisible;
+    RenderRecord                               mRecords[3];
+    unsigned int                               mRecordDeltas[3][3];
+    bool                                       mRecordsValid;
+    ListSource*                                mListSource;
+    std::vector<Element*>                      mListRows;
+    Ogre::String                               mListRowClasses;
+    float                                      mListRowHeight;
+    float                                      mListScroll;
+    size_t                                     mListIndex;
+    float                                      mListTop;
+    ClipRect                                   mClip, mChildClip;
+    bool                                       mCulled;
+    bool                                       mCascadePending;
+    bool                                       mDetached;
+    bool                                       mListening;
+    bool                                       mVeiled;
+    Ogre::String                               mBinding, mClassBinding, mBoundClass;
+    Callback*                                  mListener;
+    MamlDocument*                              mDocument;
+    size_t                                     mDocumentNode;
+    size_t                                     mCascadeStamp;
+    size_t                                     mHitBox;
+    size_t                                     mNavNode;
+  };
+  
+  // A template node's selectors and cascaded looks, copied into each instance.
+  struct TemplateLook
+  {
+   std::vector<Ogre::String> styles;
+   Ogre::String id;
+   ElementStyle normal, active, hover;
+  };
+  
+  // The nodes of a MAML "@template name" block; see PuzzleTree::instantiate.
+  struct MamlTemplate
+  {
+   MamlTemplate() : generation(std::string::npos), parent(0), parent_stamp(0) {}
+   
+  ~MamlTemplate()
+   {
+    for (size_t i=0;i < looks.size();i++)
+     delete looks[i];
+   }
+   
+   std::vector<MamlNode> nodes;
+   // One per node; 0 where it is cascaded per instance.
+   std::vector<TemplateLook*> looks;
+   // Children inherit from their parent's look, so the looks hold for the style generation, parent
+   // and parent cascade they were made with.
+   size_t generation;
+   Element* parent;
+   size_t parent_stamp;
   };
   
 }